@@ -56,39 +56,7 @@ using std::tie;
 using std::vector;
 
 template <int MAX_K>
-void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, Contigs &my_uutigs);
-
-static uint64_t estimate_num_kmers(unsigned kmer_len, vector<PackedReads *> &packed_reads_list) {
-  
-    barrier();
-  int64_t num_kmers = 0;
-  int64_t num_reads = 0;
-  int64_t tot_num_reads = 0;
-  for (auto packed_reads : packed_reads_list) {
-    tot_num_reads += packed_reads->get_local_num_reads();
-    packed_reads->reset();
-    string id, seq, quals;
-   
-    for (int i = 0; i < 100000; i++) {
-      if (!packed_reads->get_next_read(id, seq, quals)) break;
-     
-      // do not read the entire data set for just an estimate
-      if (seq.length() < kmer_len) continue;
-      num_kmers += seq.length() - kmer_len + 1;
-      num_reads++;
-    }
-    
-    barrier();
-  }
-  DBG("This rank processed ", num_reads, " reads, and found ", num_kmers, " kmers\n");
-  auto all_num_reads = reduce_one(num_reads, op_fast_add, 0).wait();
-  auto all_tot_num_reads = reduce_one(tot_num_reads, op_fast_add, 0).wait();
-  auto all_num_kmers = reduce_all(num_kmers, op_fast_add).wait();
-
-  SLOG_VERBOSE("Processed ", perc_str(all_num_reads, all_tot_num_reads), " reads, and estimated a maximum of ",
-               (all_num_reads > 0 ? all_num_kmers * (all_tot_num_reads / all_num_reads) : 0), " kmers\n");
-  return num_reads > 0 ? num_kmers * tot_num_reads / num_reads : 0;
-}
+void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, Contigs &my_uutigs, int max_walks);
 
 template <int MAX_K>
 void contigging(int kmer_len, int prev_kmer_len, int rlen_limit, vector<PackedReads *> &packed_reads_list, Contigs &ctgs,
@@ -107,20 +75,31 @@ void contigging(int kmer_len, int prev_kmer_len, int rlen_limit, vector<PackedRe
   string uutigs_fname("uutigs-" + to_string(kmer_len) + ".fasta");
   if (options->ctgs_fname != uutigs_fname) {
     Kmer<MAX_K>::set_k(kmer_len);
+    _minimizer_scheme = minimizer_scheme_from_string(options->minimizer_scheme);
+    // set before the kmer tables are loaded, which choose the kmer extensions with it
+    _dmin_thres = options->dmin_thres;
+    // the reads are normalized once, before the first kmer table is sized
+    if (options->diginorm_depth && _diginorm_reads.empty())
+      diginorm_reads<MAX_K>(kmer_len, packed_reads_list, options->diginorm_depth, (int64_t)options->diginorm_sketch_mb * ONE_MB);
     // duration of kmer_dht
     
-    int64_t my_num_kmers = estimate_num_kmers(kmer_len, packed_reads_list);
-    // use the max among all ranks
-    my_num_kmers = reduce_all(my_num_kmers, op_fast_max).wait();
-    dist_object<KmerDHT<MAX_K>> kmer_dht(world(), my_num_kmers, max_kmer_store, options->max_rpcs_in_flight,
-                                         options->use_heavy_hitters, options->use_qf);
+    dist_object<KmerDHT<MAX_K>> kmer_dht(world(), packed_reads_list, max_kmer_store, options->max_rpcs_in_flight,
+                                         options->use_heavy_hitters, options->use_qf, options->use_sort_kcount,
+                                         options->supermer_cache_size, options->balance_kmer_targets,
+                                         options->node_first_kmer_targets, options->load_kmer_tables,
+                                         options->shared_kmer_tables, options->kmer_partitions, options->kmer_spill_dir,
+                                         options->kmer_insert_thread);
     barrier();
-    analyze_kmers(kmer_len, prev_kmer_len, options->qual_offset, packed_reads_list, options->dmin_thres, ctgs, kmer_dht,
-                  options->dump_kmers);
-    
+    if (options->report_minimizer_schemes) kmer_dht->report_minimizer_schemes(packed_reads_list);
+    if (!kmer_dht->get_kmers_loaded()) {
+      analyze_kmers(kmer_len, prev_kmer_len, options->qual_offset, packed_reads_list, options->use_packed_kmer_reads,
+                    options->dedup_kmer_reads, options->dedup_kmer_reads_across_ranks, options->kmer_extraction_threads,
+                    options->dmin_thres, ctgs, kmer_dht, options->dump_kmers, options->dump_kmer_tables);
+    }
+    if (options->use_static_kmer_index) kmer_dht->build_static_index();
     barrier();
     
-    traverse_debruijn_graph(kmer_len, kmer_dht, ctgs);
+    traverse_debruijn_graph(kmer_len, kmer_dht, ctgs, options->max_traversal_walks);
     
     if (is_debug) {
       ctgs.dump_contigs(uutigs_fname, 0);
@@ -142,6 +121,12 @@ void contigging(int kmer_len, int prev_kmer_len, int rlen_limit, vector<PackedRe
     barrier();
       
 
+  } else {
+    // the packed reads, the table memory, the normalized reads and the table sizes are not needed after the last round
+    _packed_kmer_reads.clear();
+    _table_mem_pool.clear();
+    _diginorm_reads.clear();
+    _kmer_table_sizes.clear();
   }
   barrier();
   if (is_debug || options->checkpoint) {
@@ -155,9 +155,10 @@ template <int MAX_K>
 static bool check_kmers(const string &seq, dist_object<KmerDHT<MAX_K>> &kmer_dht, int kmer_len) {
   vector<Kmer<MAX_K>> kmers;
   Kmer<MAX_K>::get_kmers(kmer_len, seq, kmers, true);
-  for (auto &kmer : kmers) {
-    assert(kmer.is_valid());
-    if (!kmer_dht->kmer_exists(kmer)) return false;
+  for (auto &kmer : kmers) assert(kmer.is_valid());
+  auto lookups = kmer_dht->lookup_kmers(kmers).wait();
+  for (auto &lookup : lookups) {
+    if (!lookup.found) return false;
   }
   return true;
 }
@@ -167,6 +168,9 @@ StepInfo<MAX_K> get_next_step(dist_object<KmerDHT<MAX_K>> &kmer_dht, const Kmer<
                               const char start_prev_ext, const char start_next_ext, bool revisit_allowed, bool is_rc,
                               const global_ptr<FragElem> frag_elem_gptr) {
   StepInfo<MAX_K> step_info(start_kmer, start_prev_ext, start_next_ext);
+  // kmers are marked with a compact rank-local index instead of the full global pointer, which is only added once this fragment
+  // marks a kmer on this rank, so the steps that end straight away don't grow the index
+  uint32_t frag_idx = kmer_dht->find_frag_idx(frag_elem_gptr);
   while (true) {
     KmerCounts *kmer_counts = kmer_dht->get_local_kmer_counts(step_info.kmer);
     // this kmer doesn't exist, abort
@@ -174,8 +178,8 @@ StepInfo<MAX_K> get_next_step(dist_object<KmerDHT<MAX_K>> &kmer_dht, const Kmer<
       step_info.walk_status = WalkStatus::DEADEND;
       break;
     }
-    char left = kmer_counts->left;
-    char right = kmer_counts->right;
+    char left = kmer_counts->get_left_ext();
+    char right = kmer_counts->get_right_ext();
     if (left == 'X' || right == 'X') {
       step_info.walk_status = WalkStatus::DEADEND;
       break;
@@ -196,18 +200,19 @@ StepInfo<MAX_K> get_next_step(dist_object<KmerDHT<MAX_K>> &kmer_dht, const Kmer<
       break;
     }
     // if visited by another rank first
-    if (kmer_counts->uutig_frag && kmer_counts->uutig_frag != frag_elem_gptr) {
+    if (kmer_counts->frag_idx && kmer_counts->frag_idx != frag_idx) {
       step_info.walk_status = WalkStatus::VISITED;
-      step_info.visited_frag_elem_gptr = kmer_counts->uutig_frag;
+      step_info.visited_frag_elem_gptr = kmer_dht->get_frag_gptr(kmer_counts->frag_idx);
       break;
     }
     // a repeat, abort (but allowed if traversing right after adding start kmer previously)
-    if (kmer_counts->uutig_frag == frag_elem_gptr && !revisit_allowed) {
+    if (frag_idx && kmer_counts->frag_idx == frag_idx && !revisit_allowed) {
       step_info.walk_status = WalkStatus::REPEAT;
       break;
     }
     // mark as visited
-    kmer_counts->uutig_frag = frag_elem_gptr;
+    if (!frag_idx) frag_idx = kmer_dht->get_frag_idx(frag_elem_gptr);
+    kmer_counts->frag_idx = frag_idx;
     step_info.uutig += step_info.next_ext;
     step_info.next_ext = (dirn == Dirn::LEFT ? left : right);
     if (is_rc) step_info.kmer = step_info.kmer.revcomp();
@@ -238,26 +243,75 @@ StepInfo<MAX_K> get_next_step(dist_object<KmerDHT<MAX_K>> &kmer_dht, const Kmer<
   return step_info;
 }
 
+// the state of a walk out from a start kmer, first to the left and then to the right
+template <int MAX_K>
+struct FragWalk {
+  Kmer<MAX_K> start_kmer;
+  global_ptr<FragElem> frag_elem_gptr;
+  // the state of the walk in the current direction
+  Dirn dirn = Dirn::NONE;
+  Kmer<MAX_K> kmer;
+  char prev_ext = 0;
+  char next_ext = 0;
+  bool revisit_allowed = false;
+  // the results
+  string uutig;
+  int64_t sum_depths = 0;
+  global_ptr<FragElem> left_gptr;
+  global_ptr<FragElem> right_gptr;
+};
+
+template <int MAX_K>
+static void start_dirn(FragWalk<MAX_K> &walk, Dirn dirn) {
+  walk.dirn = dirn;
+  walk.kmer = walk.start_kmer;
+  walk.prev_ext = 0;
+  walk.next_ext = (dirn == Dirn::LEFT ? walk.kmer.front() : walk.kmer.back());
+  walk.revisit_allowed = (dirn == Dirn::LEFT ? false : true);
+  if (dirn == Dirn::RIGHT) {
+    string kmer_str = walk.kmer.to_string();
+    walk.uutig += substr_view(kmer_str, 1, kmer_str.length() - 2);
+  }
+}
+
+// returns false once the walk in the current direction has terminated
+template <int MAX_K>
+static bool add_step(FragWalk<MAX_K> &walk, const StepInfo<MAX_K> &step_info, WalkTermStats &walk_term_stats) {
+  walk.revisit_allowed = false;
+  walk.sum_depths += step_info.sum_depths;
+  walk.uutig += step_info.uutig;
+  if (step_info.walk_status != WalkStatus::RUNNING) {
+    walk_term_stats.update(step_info.walk_status);
+    if (walk.dirn == Dirn::LEFT) {
+      // reverse it because we were walking backwards
+      reverse(walk.uutig.begin(), walk.uutig.end());
+      walk.left_gptr = step_info.visited_frag_elem_gptr;
+    } else {
+      walk.right_gptr = step_info.visited_frag_elem_gptr;
+    }
+    return false;
+  }
+  // now attempt to walk to next remote kmer
+  walk.next_ext = step_info.next_ext;
+  walk.prev_ext = step_info.prev_ext;
+  walk.kmer = step_info.kmer;
+  return true;
+}
+
 static int64_t _num_rank_me_rpcs = 0;
 static int64_t _num_node_rpcs = 0;
 static int64_t _num_rpcs = 0;
 
+// Walks in the current direction until the walk terminates. The steps on this rank are taken directly, and a step on another rank
+// continues the walk when its rpc returns, so the future is ready when the walk has terminated and many walks can be in flight.
 template <int MAX_K>
-static global_ptr<FragElem> traverse_dirn(dist_object<KmerDHT<MAX_K>> &kmer_dht, Kmer<MAX_K> kmer,
-                                          global_ptr<FragElem> frag_elem_gptr, Dirn dirn, string &uutig, int64_t &sum_depths,
-                                          WalkTermStats &walk_term_stats) {
-  char prev_ext = 0;
-  char next_ext = (dirn == Dirn::LEFT ? kmer.front() : kmer.back());
-  bool revisit_allowed = (dirn == Dirn::LEFT ? false : true);
-  if (dirn == Dirn::RIGHT) {
-    string kmer_str = kmer.to_string();
-    uutig += substr_view(kmer_str, 1, kmer_str.length() - 2);
-  }
+static future<> traverse_dirn(dist_object<KmerDHT<MAX_K>> &kmer_dht, shared_ptr<FragWalk<MAX_K>> walk,
+                              WalkTermStats &walk_term_stats) {
   while (true) {
-    Kmer<MAX_K> next_kmer = kmer;
-    auto kmer_rc = kmer.revcomp();
+    Kmer<MAX_K> next_kmer = walk->kmer;
+    auto kmer_rc = walk->kmer.revcomp();
     bool is_rc = false;
-    if (kmer_rc < kmer) {
+    if (kmer_rc < next_kmer) {
       next_kmer.swap(kmer_rc);
       is_rc = true;
     }
@@ -265,31 +319,33 @@ static global_ptr<FragElem> traverse_dirn(dist_object<KmerDHT<MAX_K>> &kmer_dht,
     if (target_rank == rank_me()) _num_rank_me_rpcs++;
     if (local_team_contains(target_rank)) _num_node_rpcs++;
     _num_rpcs++;
-    StepInfo<MAX_K> step_info;
-    if (target_rank == rank_me())
-      step_info = get_next_step<MAX_K>(kmer_dht, next_kmer, dirn, prev_ext, next_ext, revisit_allowed, is_rc, frag_elem_gptr);
-    else
-      step_info = rpc(target_rank, get_next_step<MAX_K>, kmer_dht, next_kmer, dirn, prev_ext, next_ext, revisit_allowed, is_rc,
-                      frag_elem_gptr)
-                      .wait();
-    revisit_allowed = false;
-    sum_depths += step_info.sum_depths;
-    uutig += step_info.uutig;
-    if (step_info.walk_status != WalkStatus::RUNNING) {
-      walk_term_stats.update(step_info.walk_status);
-      // reverse it because we were walking backwards
-      if (dirn == Dirn::LEFT) reverse(uutig.begin(), uutig.end());
-      return step_info.visited_frag_elem_gptr;
+    if (target_rank != rank_me()) {
+      return rpc(target_rank, get_next_step<MAX_K>, kmer_dht, next_kmer, walk->dirn, walk->prev_ext, walk->next_ext,
+                 walk->revisit_allowed, is_rc, walk->frag_elem_gptr)
+          .then([&kmer_dht, walk, &walk_term_stats](const StepInfo<MAX_K> &step_info) {
+            if (!add_step(*walk, step_info, walk_term_stats)) return make_future();
+            return traverse_dirn(kmer_dht, walk, walk_term_stats);
+          });
     }
-    // now attempt to walk to next remote kmer
-    next_ext = step_info.next_ext;
-    prev_ext = step_info.prev_ext;
-    kmer = step_info.kmer;
+    auto step_info = get_next_step<MAX_K>(kmer_dht, next_kmer, walk->dirn, walk->prev_ext, walk->next_ext, walk->revisit_allowed,
+                                          is_rc, walk->frag_elem_gptr);
+    if (!add_step(*walk, step_info, walk_term_stats)) return make_future();
   }
 }
 
 template <int MAX_K>
-static void construct_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, vector<global_ptr<FragElem>> &frag_elems) {
+static future<> walk_frag(dist_object<KmerDHT<MAX_K>> &kmer_dht, shared_ptr<FragWalk<MAX_K>> walk,
+                          WalkTermStats &walk_term_stats) {
+  start_dirn(*walk, Dirn::LEFT);
+  return traverse_dirn(kmer_dht, walk, walk_term_stats).then([&kmer_dht, walk, &walk_term_stats]() {
+    start_dirn(*walk, Dirn::RIGHT);
+    return traverse_dirn(kmer_dht, walk, walk_term_stats);
+  });
+}
+
+template <int MAX_K>
+static void construct_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, vector<global_ptr<FragElem>> &frag_elems,
+                            int max_walks) {
   barrier();
   _num_rank_me_rpcs = 0;
   _num_node_rpcs = 0;
@@ -297,33 +353,44 @@ static void construct_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer
   // allocate space for biggest possible uutig in global storage
   WalkTermStats walk_term_stats = {0};
   int64_t num_walks = 0;
+  int num_active_walks = 0;
   barrier();
-  for (auto it = kmer_dht->local_kmers_begin(); it != kmer_dht->local_kmers_end(); it++) {
+  // the walks from this rank mark the kmers with different frags, so they see each other as visited, just as they do the walks
+  // from other ranks
+  kmer_dht->for_each_local_kmer([&](const Kmer<MAX_K> &kmer, KmerCounts &kmer_counts) {
     progress();
-    
-    auto kmer = it->first;
-    auto kmer_counts = &it->second;
+
     // don't start any new walk if this kmer has already been visited
-    if (kmer_counts->uutig_frag) continue;
+    if (kmer_counts.frag_idx) return;
     // don't start walks on kmers without extensions on both sides
-    if (kmer_counts->left == 'X' || kmer_counts->left == 'F' || kmer_counts->right == 'X' || kmer_counts->right == 'F') continue;
-    string uutig;
-    int64_t sum_depths = 0;
-    global_ptr<FragElem> frag_elem_gptr = new_<FragElem>();
-    auto left_gptr = traverse_dirn(kmer_dht, kmer, frag_elem_gptr, Dirn::LEFT, uutig, sum_depths, walk_term_stats);
-    auto right_gptr = traverse_dirn(kmer_dht, kmer, frag_elem_gptr, Dirn::RIGHT, uutig, sum_depths, walk_term_stats);
-    FragElem *frag_elem = frag_elem_gptr.local();
-    frag_elem->frag_seq = new_array<char>(uutig.length() + 1);
-    strcpy(frag_elem->frag_seq.local(), uutig.c_str());
-    frag_elem->frag_seq.local()[uutig.length()] = 0;
-    frag_elem->frag_len = uutig.length();
-    frag_elem->sum_depths = sum_depths;
-    frag_elem->left_gptr = left_gptr;
-    frag_elem->right_gptr = right_gptr;
-    frag_elems.push_back(frag_elem_gptr);
-    num_walks++;
-  }
-  
+    char left = kmer_counts.get_left_ext(), right = kmer_counts.get_right_ext();
+    if (left == 'X' || left == 'F' || right == 'X' || right == 'F') return;
+    if (num_active_walks >= max_walks) {
+      while (num_active_walks >= max_walks) progress();
+      // the walks that progressed may have visited this kmer
+      if (kmer_counts.frag_idx) return;
+    }
+    auto walk = make_shared<FragWalk<MAX_K>>();
+    walk->start_kmer = kmer;
+    walk->frag_elem_gptr = new_<FragElem>();
+    num_active_walks++;
+    walk_frag(kmer_dht, walk, walk_term_stats).then([walk, &frag_elems, &num_walks, &num_active_walks]() {
+      FragElem *frag_elem = walk->frag_elem_gptr.local();
+      auto &uutig = walk->uutig;
+      frag_elem->frag_seq = new_array<char>(uutig.length() + 1);
+      strcpy(frag_elem->frag_seq.local(), uutig.c_str());
+      frag_elem->frag_seq.local()[uutig.length()] = 0;
+      frag_elem->frag_len = uutig.length();
+      frag_elem->sum_depths = walk->sum_depths;
+      frag_elem->left_gptr = walk->left_gptr;
+      frag_elem->right_gptr = walk->right_gptr;
+      frag_elems.push_back(walk->frag_elem_gptr);
+      num_walks++;
+      num_active_walks--;
+    });
+  });
+  while (num_active_walks) progress();
+
   barrier();
   auto tot_rank_me_rpcs = reduce_one(_num_rank_me_rpcs, op_fast_add, 0).wait();
   auto tot_node_rpcs = reduce_one(_num_node_rpcs, op_fast_add, 0).wait();
@@ -331,6 +398,8 @@ static void construct_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer
   SLOG_VERBOSE("Required ", tot_rpcs, " rpcs, of which ", perc_str(tot_rank_me_rpcs, tot_rpcs), " were same rank, ",
                perc_str(tot_node_rpcs, tot_rpcs), " were intra-node, and ", perc_str(tot_rpcs - tot_node_rpcs, tot_rpcs),
                " were inter-node\n");
+  auto tot_num_walks = reduce_one(num_walks, op_fast_add, 0).wait();
+  SLOG_VERBOSE("Completed ", tot_num_walks, " walks with up to ", max_walks, " in flight per rank\n");
   walk_term_stats.print();
 }
 
@@ -395,7 +464,7 @@ static void clean_frag_links(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kme
   // put all the uutigs found by this rank into my_uutigs
   int64_t num_equal_links = 0, num_non_recip = 0, num_short = 0, num_left_links = 0, num_left_overlaps = 0,
           num_left_overlaps_rc = 0, num_right_links = 0, num_right_overlaps = 0, num_right_overlaps_rc = 0;
-  
+
   for (auto frag_elem_gptr : frag_elems) {
     FragElem *frag_elem = frag_elem_gptr.local();
     if (frag_elem->frag_len < kmer_len) {
@@ -416,7 +485,7 @@ static void clean_frag_links(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kme
     set_link_status(Dirn::RIGHT, frag_elem->right_gptr, frag_elem->right_is_rc, uutig, kmer_len, num_right_overlaps,
                     num_right_overlaps_rc, num_non_recip);
   }
-  
+
   barrier();
   auto all_num_frags = reduce_one(frag_elems.size(), op_fast_add, 0).wait();
   auto all_num_short = reduce_one(num_short, op_fast_add, 0).wait();
@@ -519,7 +588,7 @@ static void connect_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_d
                           Contigs &my_uutigs) {
     barrier();
   int64_t num_steps = 0, max_steps = 0, num_drops = 0, num_prev_visited = 0, num_repeats = 0;
-  
+
   for (auto frag_elem_gptr : frag_elems) {
     FragElem *frag_elem = frag_elem_gptr.local();
     if (frag_elem->frag_len < kmer_len) continue;
@@ -546,7 +615,7 @@ static void connect_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_d
       num_drops++;
     }
   }
-  
+
   auto all_num_steps = reduce_one(num_steps, op_fast_add, 0).wait();
   auto all_max_steps = reduce_one(max_steps, op_fast_max, 0).wait();
   auto all_num_drops = reduce_one(num_drops, op_fast_add, 0).wait();
@@ -567,12 +636,12 @@ static void connect_frags(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_d
 }
 
 template <int MAX_K>
-void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, Contigs &my_uutigs) {
+void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kmer_dht, Contigs &my_uutigs, int max_walks) {
     barrier();
   {
     // scope for frag_elems
     vector<global_ptr<FragElem>> frag_elems;
-    construct_frags(kmer_len, kmer_dht, frag_elems);
+    construct_frags(kmer_len, kmer_dht, frag_elems, max_walks);
     clean_frag_links(kmer_len, kmer_dht, frag_elems);
     // put all the uutigs found by this rank into my_uutigs
     my_uutigs.clear();
@@ -587,7 +656,7 @@ void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kme
   fut.wait();
   barrier();
 #ifdef DEBUG
-  
+
   for (auto uutig : my_uutigs) {
     if (!check_kmers(uutig.seq, kmer_dht, kmer_len)) DIE("kmer not found in uutig");
   }
@@ -595,8 +664,9 @@ void traverse_debruijn_graph(unsigned kmer_len, dist_object<KmerDHT<MAX_K>> &kme
 #endif
 }
 
-#define TDG_K(KMER_LEN) \
-  template void traverse_debruijn_graph<KMER_LEN>(unsigned kmer_len, dist_object<KmerDHT<KMER_LEN>> &kmer_dht, Contigs &my_uutigs)
+#define TDG_K(KMER_LEN)                                                                                                \
+  template void traverse_debruijn_graph<KMER_LEN>(unsigned kmer_len, dist_object<KmerDHT<KMER_LEN>> &kmer_dht, Contigs &my_uutigs, \
+                                                  int max_walks)
 
 TDG_K(32);
 #if MAX_BUILD_KMER >= 64
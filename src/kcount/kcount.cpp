@@ -40,8 +40,12 @@
  form.
 */
 
+#include <chrono>
+#include <iomanip>
+
 #include "upcxx_utils.hpp"
 #include "utils.hpp"
+#include "hash_funcs.h"
 #include "kcount.hpp"
 
 //#define DBG_ADD_KMER DBG
@@ -51,8 +55,201 @@ using namespace std;
 using namespace upcxx_utils;
 using namespace upcxx;
 
+// canonical kmer hashes, so that a kmer and its revcomp are counted together
+template <int MAX_K>
+static void get_canonical_kmer_hashes(unsigned kmer_len, const string &seq, vector<Kmer<MAX_K>> &kmers,
+                                      vector<uint64_t> &hashes) {
+  Kmer<MAX_K>::get_kmers(kmer_len, seq, kmers);
+  hashes.resize(kmers.size());
+  for (size_t i = 0; i < kmers.size(); i++) {
+    auto kmer_rc = kmers[i].revcomp();
+    hashes[i] = (kmer_rc < kmers[i] ? kmer_rc.hash() : kmers[i].hash());
+  }
+}
+
+// Digital normalization of over-represented reads. The kmer abundances over all the reads are counted in a count-min sketch,
+// and then each read whose median kmer abundance is above the target depth is kept with a probability of depth / abundance, so
+// that regions of any higher depth are brought down to about the target depth while the rest keep all their reads. The choice
+// is a hash of the read position rather than the order of the reads, so it is the same for every run on the same ranks.
+template <int MAX_K>
+void diginorm_reads(unsigned kmer_len, vector<PackedReads *> &packed_reads_list, int diginorm_depth, int64_t sketch_bytes) {
+  auto start_t = chrono::high_resolution_clock::now();
+  _diginorm_reads.clear();
+  CountMinSketch sketch(sketch_bytes);
+  // the distinct kmers in all the reads and in the kept reads show how much smaller the kmer tables will be
+  HyperLogLog all_distinct_sketch, kept_distinct_sketch;
+  vector<Kmer<MAX_K>> kmers;
+  vector<uint64_t> hashes;
+  string id, seq, quals;
+  for (auto packed_reads : packed_reads_list) {
+    packed_reads->reset();
+    while (packed_reads->get_next_read(id, seq, quals)) {
+      if (seq.length() < kmer_len) continue;
+      get_canonical_kmer_hashes(kmer_len, seq, kmers, hashes);
+      for (auto hash : hashes) {
+        sketch.add(hash);
+        all_distinct_sketch.add(hash);
+      }
+      progress();
+    }
+  }
+  sketch.merge_all();
+  all_distinct_sketch.merge_all();
+
+  int64_t num_reads = 0, num_kept_reads = 0, num_kmers = 0, num_kept_kmers = 0;
+  vector<uint32_t> abundances;
+  _diginorm_reads.kept.resize(packed_reads_list.size());
+  for (int lib_i = 0; lib_i < (int)packed_reads_list.size(); lib_i++) {
+    auto packed_reads = packed_reads_list[lib_i];
+    auto &kept = _diginorm_reads.kept[lib_i];
+    kept.resize(packed_reads->get_local_num_reads(), true);
+    packed_reads->reset();
+    while (packed_reads->get_next_read(id, seq, quals)) {
+      auto read_i = packed_reads->get_read_index() - 1;
+      num_reads++;
+      progress();
+      if (seq.length() < kmer_len) {
+        num_kept_reads++;
+        continue;
+      }
+      get_canonical_kmer_hashes(kmer_len, seq, kmers, hashes);
+      abundances.resize(hashes.size());
+      for (size_t i = 0; i < hashes.size(); i++) abundances[i] = sketch.estimate(hashes[i]);
+      auto median = abundances.begin() + abundances.size() / 2;
+      nth_element(abundances.begin(), median, abundances.end());
+      num_kmers += hashes.size();
+      if (*median > (uint32_t)diginorm_depth) {
+        // a uniform value in [0, 1) from the top 53 bits of the hash
+        double r = (quick_hash(((uint64_t)rank_me() << 40) ^ ((uint64_t)lib_i << 32) ^ read_i) >> 11) * 0x1.0p-53;
+        if (r >= (double)diginorm_depth / *median) {
+          kept[read_i] = false;
+          continue;
+        }
+      }
+      num_kept_reads++;
+      num_kept_kmers += hashes.size();
+      for (auto hash : hashes) kept_distinct_sketch.add(hash);
+    }
+  }
+  kept_distinct_sketch.merge_all();
+  auto all_num_reads = reduce_one(num_reads, op_fast_add, 0).wait();
+  auto all_num_kept_reads = reduce_one(num_kept_reads, op_fast_add, 0).wait();
+  auto all_num_kmers = reduce_one(num_kmers, op_fast_add, 0).wait();
+  auto all_num_kept_kmers = reduce_one(num_kept_kmers, op_fast_add, 0).wait();
+  chrono::duration<double> t_elapsed = chrono::high_resolution_clock::now() - start_t;
+  SLOG("Digital normalization to depth ", diginorm_depth, " kept ", perc_str(all_num_kept_reads, all_num_reads), " reads and ",
+       perc_str(all_num_kept_kmers, all_num_kmers), " kmers to count, estimated distinct kmers ",
+       (int64_t)all_distinct_sketch.estimate(), " -> ", (int64_t)kept_distinct_sketch.estimate(), " (", fixed,
+       setprecision(2), t_elapsed.count(), " s)\n");
+}
+
+// sends each distinct packed read to a rank chosen by its hash, so that the copies from all the ranks are combined there
+static void combine_read_copies_across_ranks(HASH_TABLE<string, uint32_t> &read_copies) {
+  const size_t MAX_SEND_BYTES = ONE_MB;
+  dist_object<HASH_TABLE<string, uint32_t>> rank_read_copies({});
+  struct TargetReads {
+    vector<string> packed_seqs;
+    vector<uint32_t> copies;
+    size_t bytes = 0;
+  };
+  vector<TargetReads> target_reads(rank_n());
+  future<> fut_all = make_future();
+  auto send_reads = [&rank_read_copies, &fut_all](intrank_t target_rank, TargetReads &target) {
+    auto fut = rpc(
+        target_rank,
+        [](dist_object<HASH_TABLE<string, uint32_t>> &rank_read_copies, const vector<string> &packed_seqs,
+           view<uint32_t> copies) {
+          auto copies_it = copies.begin();
+          for (auto &packed_seq : packed_seqs) (*rank_read_copies)[packed_seq] += *copies_it++;
+        },
+        rank_read_copies, target.packed_seqs, make_view(target.copies));
+    fut_all = when_all(fut_all, fut);
+    target.packed_seqs.clear();
+    target.copies.clear();
+    target.bytes = 0;
+  };
+  for (auto &[packed_seq, copies] : read_copies) {
+    intrank_t target_rank = std::hash<string>{}(packed_seq) % rank_n();
+    if (target_rank == rank_me()) {
+      (*rank_read_copies)[packed_seq] += copies;
+      continue;
+    }
+    auto &target = target_reads[target_rank];
+    target.packed_seqs.push_back(packed_seq);
+    target.copies.push_back(copies);
+    target.bytes += packed_seq.length() + sizeof(uint32_t);
+    if (target.bytes >= MAX_SEND_BYTES) send_reads(target_rank, target);
+    progress();
+  }
+  HASH_TABLE<string, uint32_t>().swap(read_copies);
+  for (intrank_t target_rank = 0; target_rank < rank_n(); target_rank++) {
+    if (!target_reads[target_rank].packed_seqs.empty()) send_reads(target_rank, target_reads[target_rank]);
+  }
+  fut_all.wait();
+  barrier();
+  read_copies.swap(*rank_read_copies);
+}
+
+// a single scan of all the reads, which are then reused packed for every round
+static void pack_kmer_reads(unsigned kmer_len, int qual_offset, vector<PackedReads *> &packed_reads_list, bool dedup_kmer_reads,
+                            bool dedup_across_ranks) {
+  _packed_kmer_reads.clear();
+  Supermer supermer;
+  // identical packed reads are only kept once, with their number of copies used as the depth of their kmers
+  HASH_TABLE<string, uint32_t> read_copies;
+  int64_t num_packed_reads = 0;
+  for (int lib_i = 0; lib_i < (int)packed_reads_list.size(); lib_i++) {
+    auto packed_reads = packed_reads_list[lib_i];
+    packed_reads->reset();
+    string id, seq, quals;
+    while (true) {
+      if (!packed_reads->get_next_read(id, seq, quals)) break;
+      _packed_kmer_reads.num_reads++;
+      // reads dropped by digital normalization are never needed again
+      if (!_diginorm_reads.is_kept(lib_i, packed_reads->get_read_index() - 1)) continue;
+      if (seq.length() < kmer_len) continue;
+      for (int i = 0; i < seq.length(); i++) {
+        if (quals[i] < qual_offset + KCOUNT_QUAL_CUTOFF) seq[i] = tolower(seq[i]);
+      }
+      supermer.pack(seq);
+      num_packed_reads++;
+      if (dedup_kmer_reads) {
+        read_copies[supermer.seq]++;
+      } else {
+        _packed_kmer_reads.offsets.push_back(_packed_kmer_reads.packed_seqs.length());
+        _packed_kmer_reads.packed_seqs += supermer.seq;
+      }
+      progress();
+    }
+  }
+  if (dedup_kmer_reads) {
+    if (dedup_across_ranks) combine_read_copies_across_ranks(read_copies);
+    _packed_kmer_reads.offsets.reserve(read_copies.size());
+    _packed_kmer_reads.copies.reserve(read_copies.size());
+    for (auto &[packed_seq, copies] : read_copies) {
+      _packed_kmer_reads.offsets.push_back(_packed_kmer_reads.packed_seqs.length());
+      _packed_kmer_reads.packed_seqs += packed_seq;
+      _packed_kmer_reads.copies.push_back(copies);
+    }
+    HASH_TABLE<string, uint32_t>().swap(read_copies);
+    auto all_num_packed_reads = reduce_one(num_packed_reads, op_fast_add, 0).wait();
+    auto all_num_distinct_reads = reduce_one(_packed_kmer_reads.size(), op_fast_add, 0).wait();
+    SLOG_VERBOSE("Deduplicated ", all_num_packed_reads, " reads for kmer counting ", (dedup_across_ranks ? "across" : "within"),
+                 " processes into ", perc_str(all_num_distinct_reads, all_num_packed_reads), " distinct reads\n");
+  }
+  _packed_kmer_reads.packed_seqs.shrink_to_fit();
+  _packed_kmer_reads.offsets.shrink_to_fit();
+  _packed_kmer_reads.is_packed = true;
+  auto all_packed_bytes = reduce_one(_packed_kmer_reads.packed_seqs.capacity() + _packed_kmer_reads.offsets.capacity() * 8 +
+                                         _packed_kmer_reads.copies.capacity() * 4,
+                                     op_fast_add, 0)
+                              .wait();
+  SLOG_VERBOSE("Packed the reads for kmer counting into ", get_size_str(all_packed_bytes), "\n");
+}
+
 template <int MAX_K>
 static void count_kmers(unsigned kmer_len, int qual_offset, vector<PackedReads *> &packed_reads_list,
+                        bool use_packed_kmer_reads, bool dedup_kmer_reads, bool dedup_across_ranks, int kmer_extraction_threads,
                         dist_object<KmerDHT<MAX_K>> &kmer_dht) {
  
   int64_t num_reads = 0;
@@ -62,30 +259,59 @@ static void count_kmers(unsigned kmer_len, int qual_offset, vector<PackedReads *
 
  
   barrier();
-  SeqBlockInserter<MAX_K> seq_block_inserter(qual_offset, kmer_dht->get_minimizer_len());
+  SeqBlockInserter<MAX_K> seq_block_inserter(qual_offset, kmer_dht->get_minimizer_len(), kmer_dht->get_num_minimizer_buckets(),
+                                              kmer_extraction_threads);
   int64_t tot_num_local_reads = 0;
   for (auto packed_reads : packed_reads_list) {
     tot_num_local_reads += packed_reads->get_local_num_reads();
   }
-  
-  for (auto packed_reads : packed_reads_list) {
-    packed_reads->reset();
-    string id, seq, quals;
-    while (true) {
-      if (!packed_reads->get_next_read(id, seq, quals)) break;
-      num_reads++;
-      
-      if (seq.length() < kmer_len) continue;
-      tot_read_len += seq.length();
-      for (int i = 0; i < seq.length(); i++) {
-        if (quals[i] < qual_offset + KCOUNT_QUAL_CUTOFF) {
-          seq[i] = tolower(seq[i]);
-          num_bad_quals++;
+  // the deduplicated reads are only kept packed
+  if (dedup_across_ranks) dedup_kmer_reads = true;
+  if (dedup_kmer_reads) use_packed_kmer_reads = true;
+  if (use_packed_kmer_reads && !SeqBlockInserter<MAX_K>::supports_packed_seqs()) {
+    SWARN("Packed and deduplicated reads for kmer counting are not available on the GPU, unpacking all the reads every round");
+    use_packed_kmer_reads = false;
+  }
+
+  if (use_packed_kmer_reads) {
+    if (!_packed_kmer_reads.is_packed)
+      pack_kmer_reads(kmer_len, qual_offset, packed_reads_list, dedup_kmer_reads, dedup_across_ranks);
+    num_reads = _packed_kmer_reads.num_reads;
+    for (int64_t i = 0; i < _packed_kmer_reads.size(); i++) {
+      auto packed_seq = _packed_kmer_reads.get_packed_seq(i);
+      if (packed_seq.len < (int)kmer_len) continue;
+      auto depth = _packed_kmer_reads.get_depth(i);
+      int64_t num_copies = (depth ? depth : 1);
+      tot_read_len += packed_seq.len * num_copies;
+      if (packed_seq.quals) {
+        for (int j = 0; j < packed_seq.len; j++) {
+          if (!packed_seq.is_good_qual(j)) num_bad_quals += num_copies;
         }
       }
-      seq_block_inserter.process_seq(seq, 0, kmer_dht);
+      seq_block_inserter.process_packed_seq(packed_seq, depth, kmer_dht);
       progress();
     }
+  } else {
+    for (int lib_i = 0; lib_i < (int)packed_reads_list.size(); lib_i++) {
+      auto packed_reads = packed_reads_list[lib_i];
+      packed_reads->reset();
+      string id, seq, quals;
+      while (true) {
+        if (!packed_reads->get_next_read(id, seq, quals)) break;
+        num_reads++;
+        if (!_diginorm_reads.is_kept(lib_i, packed_reads->get_read_index() - 1)) continue;
+        if (seq.length() < kmer_len) continue;
+        tot_read_len += seq.length();
+        for (int i = 0; i < seq.length(); i++) {
+          if (quals[i] < qual_offset + KCOUNT_QUAL_CUTOFF) {
+            seq[i] = tolower(seq[i]);
+            num_bad_quals++;
+          }
+        }
+        seq_block_inserter.process_seq(seq, 0, kmer_dht);
+        progress();
+      }
+    }
   }
   seq_block_inserter.done_processing(kmer_dht);
   
@@ -105,7 +331,7 @@ static void add_ctg_kmers(unsigned kmer_len, unsigned prev_kmer_len, Contigs &ct
 
   auto start_local_num_kmers = kmer_dht->get_local_num_kmers();
 
-  SeqBlockInserter<MAX_K> seq_block_inserter(0, kmer_dht->get_minimizer_len());
+  SeqBlockInserter<MAX_K> seq_block_inserter(0, kmer_dht->get_minimizer_len(), kmer_dht->get_num_minimizer_buckets());
   barrier();
   DBG("After seq_block_inserter constructor, with ", ctgs.size(), " ctgs\n");
   //WARN("After seq_block_inserter constructor, with ", ctgs.size(), " ctgs\n");
@@ -139,18 +365,20 @@ static void add_ctg_kmers(unsigned kmer_len, unsigned prev_kmer_len, Contigs &ct
 
 template <int MAX_K>
 void analyze_kmers(unsigned kmer_len, unsigned prev_kmer_len, int qual_offset, vector<PackedReads *> &packed_reads_list,
-                   int dmin_thres, Contigs &ctgs, dist_object<KmerDHT<MAX_K>> &kmer_dht, bool dump_kmers) {
+                   bool use_packed_kmer_reads, bool dedup_kmer_reads, bool dedup_across_ranks, int kmer_extraction_threads,
+                   int dmin_thres, Contigs &ctgs, dist_object<KmerDHT<MAX_K>> &kmer_dht, bool dump_kmers, bool dump_kmer_tables) {
   
   auto fut_has_contigs = upcxx::reduce_all(ctgs.size(), upcxx::op_fast_max).then([](size_t max_ctgs) { return max_ctgs > 0; });
   _dmin_thres = dmin_thres;
 
-  count_kmers(kmer_len, qual_offset, packed_reads_list, kmer_dht);
+  count_kmers(kmer_len, qual_offset, packed_reads_list, use_packed_kmer_reads, dedup_kmer_reads, dedup_across_ranks,
+              kmer_extraction_threads, kmer_dht);
   barrier();
   if (fut_has_contigs.wait()) {
     add_ctg_kmers(kmer_len, prev_kmer_len, ctgs, kmer_dht);
     barrier();
   }
-  kmer_dht->finish_updates();
+  kmer_dht->finish_updates(dump_kmer_tables);
   if (dump_kmers) kmer_dht->dump_kmers();
   barrier();
   kmer_dht->clear_stores();
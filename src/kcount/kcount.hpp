@@ -42,6 +42,7 @@
  form.
 */
 
+#include <limits>
 #include <vector>
 
 #include "contigs.hpp"
@@ -59,22 +60,74 @@ struct SeqBlockInserter {
   struct SeqBlockInserterState;
   SeqBlockInserterState *state = nullptr;
 
-  SeqBlockInserter(int qual_offset, int minimizer_len);
+  // on the CPU, with num_threads the seqs are collected into blocks and the supermers of each block are extracted by that many
+  // thread pool tasks, while the master persona only sends them; the GPU always processes blocks on the device
+  SeqBlockInserter(int qual_offset, int minimizer_len, int num_minimizer_buckets, int num_threads = 0);
 
   ~SeqBlockInserter();
 
   void process_seq(string &seq, kmer_count_t depth, dist_object<KmerDHT<MAX_K>> &kmer_dht);
 
+  // the GPU build parses its own packing of the reads on the device, so it can only process unpacked seqs
+  static bool supports_packed_seqs();
+
+  void process_packed_seq(const PackedSupermerView &packed_seq, kmer_count_t depth, dist_object<KmerDHT<MAX_K>> &kmer_dht);
+
   void done_processing(dist_object<KmerDHT<MAX_K>> &kmer_dht);
 };
 
+// The reads packed once for all the rounds of kmer counting, in the supermer format (2 bits per base and a bitmask of the good
+// quality positions), so that every round gets its kmers straight from the packed bases instead of unpacking and quality
+// masking all the reads again. Reads shorter than the first kmer length are left out, since they can't contain any kmers in
+// later rounds either. Only the reading and packing is shared: every round still computes its own minimizers, and splits and
+// routes its own supermers, since they depend on the k and the kmer dht of that round. When the reads are deduplicated, each distinct packed read is kept once with its number of copies.
+struct PackedKmerReads {
+  string packed_seqs;
+  vector<int64_t> offsets;
+  // empty unless the reads are deduplicated
+  vector<uint32_t> copies;
+  // the total number of reads, including those left out
+  int64_t num_reads = 0;
+  // set even when there are no reads on this rank, so that all the ranks pack their reads collectively in the same round
+  bool is_packed = false;
+
+  int64_t size() const { return offsets.size(); }
+
+  // the depth to count the kmers of a packed read with, where 0 is a single read
+  kmer_count_t get_depth(int64_t i) const {
+    if (copies.empty()) return 0;
+    return std::min(copies[i], (uint32_t)std::numeric_limits<kmer_count_t>::max());
+  }
+
+  PackedSupermerView get_packed_seq(int64_t i) const {
+    int64_t end = (i + 1 < (int64_t)offsets.size() ? offsets[i + 1] : packed_seqs.size());
+    return PackedSupermerView::unpack((const uint8_t *)packed_seqs.data() + offsets[i], end - offsets[i]);
+  }
+
+  void clear() {
+    string().swap(packed_seqs);
+    vector<int64_t>().swap(offsets);
+    vector<uint32_t>().swap(copies);
+    num_reads = 0;
+    is_packed = false;
+  }
+};
+
+// global so that it lasts across the rounds, which each count kmers with a different template instance
+inline PackedKmerReads _packed_kmer_reads;
+
+template <int MAX_K>
+void diginorm_reads(unsigned kmer_len, vector<PackedReads *> &packed_reads_list, int diginorm_depth, int64_t sketch_bytes);
+
 template <int MAX_K>
 void analyze_kmers(unsigned kmer_len, unsigned prev_kmer_len, int qual_offset, vector<PackedReads *> &packed_reads_list,
-                   int dmin_thres, Contigs &ctgs, dist_object<KmerDHT<MAX_K>> &kmer_dht, bool dump_kmers);
+                   bool use_packed_kmer_reads, bool dedup_kmer_reads, bool dedup_across_ranks, int kmer_extraction_threads,
+                   int dmin_thres, Contigs &ctgs, dist_object<KmerDHT<MAX_K>> &kmer_dht, bool dump_kmers, bool dump_kmer_tables);
 
-#define __MACRO_KCOUNT__(KMER_LEN, MODIFIER)                                                              \
-  MODIFIER void analyze_kmers<KMER_LEN>(unsigned, unsigned, int, vector<PackedReads *> &, int, Contigs &, \
-                                        dist_object<KmerDHT<KMER_LEN>> &, bool)
+#define __MACRO_KCOUNT__(KMER_LEN, MODIFIER)                                                                    \
+  MODIFIER void diginorm_reads<KMER_LEN>(unsigned, vector<PackedReads *> &, int, int64_t);                      \
+  MODIFIER void analyze_kmers<KMER_LEN>(unsigned, unsigned, int, vector<PackedReads *> &, bool, bool, bool,     \
+                                        int, int, Contigs &, dist_object<KmerDHT<KMER_LEN>> &, bool, bool)
 
 // Reduce compile time by instantiating templates of common types
 // extern template declarations are in in kcount.hpp
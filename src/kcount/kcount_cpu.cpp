@@ -40,6 +40,10 @@ n
  form.
 */
 
+#include <unistd.h>
+
+#include <fstream>
+
 #include "upcxx_utils.hpp"
 #include "kcount.hpp"
 #include "kmer_dht.hpp"
@@ -52,17 +56,61 @@ using namespace upcxx_utils;
 //#define SLOG_CPU_HT(...) SLOG(KLGREEN, __VA_ARGS__, KNORM)
 #define SLOG_CPU_HT(...) SLOG_VERBOSE(__VA_ARGS__)
 
+// the supermers extracted from part of a block of seqs by one thread pool task
+template <int MAX_K>
+struct BlockSupermers {
+  vector<Supermer> supermers;
+  vector<intrank_t> target_ranks;
+  int64_t num_kmers = 0;
+  int64_t bytes_kmers_sent = 0;
+  int64_t num_flat_supermers = 0;
+};
+
+// A block of seqs collected for extracting their supermers in the thread pool. The unpacked seqs are copied into the block, but
+// the packed seqs are only referenced, since they are kept for all the rounds.
+struct SeqBlock {
+  struct BlockSeq {
+    // offset into the unpacked seqs, or -1 for a packed seq
+    int64_t offset;
+    int len;
+    PackedSupermerView packed_seq;
+    kmer_count_t depth;
+  };
+  string unpacked_seqs;
+  vector<BlockSeq> seqs;
+  int64_t num_bases = 0;
+
+  void clear() {
+    unpacked_seqs.clear();
+    seqs.clear();
+    num_bases = 0;
+  }
+};
+
 template <int MAX_K>
 struct SeqBlockInserter<MAX_K>::SeqBlockInserterState {
   int64_t bytes_kmers_sent = 0;
   int64_t bytes_supermers_sent = 0;
+  int64_t bytes_supermers_sent_off_node = 0;
+  int64_t num_supermers = 0;
+  // the supermers there would have been without node first targets
+  int64_t num_flat_supermers = 0;
   int64_t num_kmers = 0;
   vector<Kmer<MAX_K>> kmers;
+  // with threads, the seqs are collected into one block while the tasks extract the supermers of the previous one
+  int num_threads = 0;
+  SeqBlock block;
+  SeqBlock busy_block;
+  vector<BlockSupermers<MAX_K>> task_supermers;
+  vector<future<>> task_futs;
+  int64_t num_blocks = 0;
+  int64_t num_block_waits = 0;
 };
 
 template <int MAX_K>
-SeqBlockInserter<MAX_K>::SeqBlockInserter(int qual_offset, int minimizer_len) {
+SeqBlockInserter<MAX_K>::SeqBlockInserter(int qual_offset, int minimizer_len, int num_minimizer_buckets, int num_threads) {
   state = new SeqBlockInserterState();
+  state->num_threads = num_threads;
 }
 
 template <int MAX_K>
@@ -70,171 +118,523 @@ SeqBlockInserter<MAX_K>::~SeqBlockInserter() {
   if (state) delete state;
 }
 
-template <int MAX_K>
-void SeqBlockInserter<MAX_K>::process_seq(string &seq, kmer_count_t depth, dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+// Splits the canonical kmers of a seq into supermers of consecutive kmers with the same target rank (and the same partition on
+// that rank, if the kmers are partitioned), packing each one from its position in the seq with pack_supermer and passing it on
+// with emit_supermer. This only reads the kmer dht, so it can run on any thread. With node first targets, it returns the number
+// of supermers the seq would have been split into without them, otherwise 0.
+template <int MAX_K, typename PackFunc, typename EmitFunc>
+static int get_supermers(vector<Kmer<MAX_K>> &kmers, int seq_len, kmer_count_t depth, const KmerDHT<MAX_K> &kmer_dht,
+                         PackFunc pack_supermer, EmitFunc emit_supermer) {
   if (!depth) depth = 1;
   auto kmer_len = Kmer<MAX_K>::get_k();
-  Kmer<MAX_K>::get_kmers(kmer_len, seq, state->kmers);
-  for (int i = 0; i < state->kmers.size(); i++) {
-    state->bytes_kmers_sent += sizeof(KmerAndExt<MAX_K>);
-    Kmer<MAX_K> kmer_rc = state->kmers[i].revcomp();
-    if (kmer_rc < state->kmers[i]) state->kmers[i] = kmer_rc;
-  }
-
-  Supermer supermer{.seq = seq.substr(0, kmer_len + 1), .count = (kmer_count_t)depth};
-  auto prev_target_rank = kmer_dht->get_kmer_target_rank(state->kmers[1]);
-  for (int i = 1; i < (int)(seq.length() - kmer_len); i++) {
-    auto &kmer = state->kmers[i];
-    auto target_rank = kmer_dht->get_kmer_target_rank(kmer);
-    if (target_rank == prev_target_rank) {
-      supermer.seq += seq[i + kmer_len];
+  // every kmer in a supermer needs both its extensions
+  if (seq_len < kmer_len + 2) return 0;
+  for (int i = 0; i < kmers.size(); i++) {
+    Kmer<MAX_K> kmer_rc = kmers[i].revcomp();
+    if (kmer_rc < kmers[i]) kmers[i] = kmer_rc;
+  }
+
+  Supermer supermer{.seq = "", .count = (kmer_count_t)depth};
+  int supermer_start = 0;
+  int supermer_len = kmer_len + 1;
+  auto num_partitions = kmer_dht.get_num_kmer_partitions();
+  auto prev_target = kmer_dht.get_kmer_target(kmers[1]);
+  // the same splitting with the flat targets, only counted
+  bool count_flat = kmer_dht.uses_node_first_targets();
+  int num_flat_supermers = 0;
+  int flat_supermer_len = kmer_len + 1;
+  auto prev_flat_target = count_flat ? kmer_dht.get_flat_kmer_target_rank(kmers[1]) : 0;
+  for (int i = 1; i < (int)(seq_len - kmer_len); i++) {
+    auto &kmer = kmers[i];
+    auto target = kmer_dht.get_kmer_target(kmer);
+    if (count_flat) {
+      auto flat_target = kmer_dht.get_flat_kmer_target_rank(kmer);
+      if (flat_target == prev_flat_target && flat_supermer_len < SupermerChunk<MAX_K>::MAX_BASES) {
+        flat_supermer_len++;
+      } else {
+        num_flat_supermers++;
+        flat_supermer_len = kmer_len + 2;
+        prev_flat_target = flat_target;
+      }
+    }
+    // long supermers are split with an overlap of k + 1 bases, so that every kmer is sent once with both its extensions
+    if (target == prev_target && supermer_len < SupermerChunk<MAX_K>::MAX_BASES) {
+      supermer_len++;
+    } else {
+      pack_supermer(supermer, supermer_start, supermer_len);
+      emit_supermer(supermer, prev_target / num_partitions);
+      supermer_start = i - 1;
+      supermer_len = kmer_len + 2;
+      prev_target = target;
+    }
+  }
+  if (supermer_len >= kmer_len + 2) {
+    pack_supermer(supermer, supermer_start, supermer_len);
+    emit_supermer(supermer, prev_target / num_partitions);
+  }
+  if (count_flat) num_flat_supermers++;
+  return num_flat_supermers;
+}
+
+template <int MAX_K>
+static void add_supermer(SeqBlockInserter<MAX_K> *sbi, Supermer &supermer, intrank_t target_rank,
+                         dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  auto record_bytes = SupermerChunk<MAX_K>::get_record_bytes(supermer.seq.length());
+  sbi->state->num_supermers++;
+  sbi->state->bytes_supermers_sent += record_bytes;
+  if (!local_team_contains(target_rank)) sbi->state->bytes_supermers_sent_off_node += record_bytes;
+  kmer_dht->add_supermer(supermer, target_rank);
+}
+
+// sends the kmers already in the state as supermers, packing each one from its position in the seq with pack_supermer
+template <int MAX_K, typename PackFunc>
+static void send_supermers(SeqBlockInserter<MAX_K> *sbi, int seq_len, kmer_count_t depth, dist_object<KmerDHT<MAX_K>> &kmer_dht,
+                           PackFunc pack_supermer) {
+  auto state = sbi->state;
+  state->bytes_kmers_sent += sizeof(KmerAndExt<MAX_K>) * state->kmers.size();
+  auto emit_supermer = [sbi, &kmer_dht](Supermer &supermer, intrank_t target_rank) {
+    add_supermer(sbi, supermer, target_rank, kmer_dht);
+  };
+  state->num_flat_supermers += get_supermers(state->kmers, seq_len, depth, *kmer_dht, pack_supermer, emit_supermer);
+  state->num_kmers += seq_len - 2 - Kmer<MAX_K>::get_k();
+}
+
+// the work of one thread pool task: extracts the supermers of a range of the seqs in a block
+template <int MAX_K>
+static void extract_block_supermers(const SeqBlock &block, int64_t start, int64_t end, const KmerDHT<MAX_K> &kmer_dht,
+                                    BlockSupermers<MAX_K> &block_supermers) {
+  auto kmer_len = Kmer<MAX_K>::get_k();
+  vector<Kmer<MAX_K>> kmers;
+  auto emit_supermer = [&block_supermers](Supermer &supermer, intrank_t target_rank) {
+    block_supermers.supermers.push_back(supermer);
+    block_supermers.target_ranks.push_back(target_rank);
+  };
+  for (int64_t i = start; i < end; i++) {
+    auto &block_seq = block.seqs[i];
+    if (block_seq.offset >= 0) {
+      string_view seq(block.unpacked_seqs.data() + block_seq.offset, block_seq.len);
+      Kmer<MAX_K>::get_kmers(kmer_len, string(seq), kmers);
+      block_supermers.num_flat_supermers +=
+          get_supermers(kmers, block_seq.len, block_seq.depth, kmer_dht, [&seq](Supermer &supermer, int start, int len) {
+            supermer.pack(seq.substr(start, len));
+          }, emit_supermer);
     } else {
-      state->bytes_supermers_sent += supermer.get_bytes();
-      kmer_dht->add_supermer(supermer, prev_target_rank);
-      supermer.seq = seq.substr(i - 1, kmer_len + 2);
-      prev_target_rank = target_rank;
+      auto &packed_seq = block_seq.packed_seq;
+      Kmer<MAX_K>::get_kmers_from_packed(kmer_len, packed_seq.bases, packed_seq.len, kmers);
+      block_supermers.num_flat_supermers +=
+          get_supermers(kmers, packed_seq.len, block_seq.depth, kmer_dht, [&packed_seq](Supermer &supermer, int start, int len) {
+            supermer.pack(packed_seq, start, len);
+          }, emit_supermer);
+    }
+    block_supermers.bytes_kmers_sent += sizeof(KmerAndExt<MAX_K>) * kmers.size();
+    block_supermers.num_kmers += block_seq.len - 2 - kmer_len;
+  }
+}
+
+// waits for the tasks of the busy block in order, sending the supermers of each task as soon as it is done
+template <int MAX_K>
+static void send_block_supermers(SeqBlockInserter<MAX_K> *sbi, dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  auto state = sbi->state;
+  for (int i = 0; i < (int)state->task_futs.size(); i++) {
+    while (!state->task_futs[i].ready()) {
+      state->num_block_waits++;
+      progress();
     }
+    auto &block_supermers = state->task_supermers[i];
+    for (size_t j = 0; j < block_supermers.supermers.size(); j++)
+      add_supermer(sbi, block_supermers.supermers[j], block_supermers.target_ranks[j], kmer_dht);
+    state->num_kmers += block_supermers.num_kmers;
+    state->bytes_kmers_sent += block_supermers.bytes_kmers_sent;
+    state->num_flat_supermers += block_supermers.num_flat_supermers;
+    block_supermers = {};
+    progress();
+  }
+  state->task_futs.clear();
+  state->busy_block.clear();
+}
+
+// sends the supermers of the previous block and starts the tasks for the current one, split into ranges of about the same
+// number of bases
+template <int MAX_K>
+static void process_block(SeqBlockInserter<MAX_K> *sbi, dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  auto state = sbi->state;
+  send_block_supermers(sbi, kmer_dht);
+  if (state->block.seqs.empty()) return;
+  swap(state->block, state->busy_block);
+  state->num_blocks++;
+  state->task_supermers.resize(state->num_threads);
+  const KmerDHT<MAX_K> *dht = &(*kmer_dht);
+  auto &block = state->busy_block;
+  int64_t bases_per_task = block.num_bases / state->num_threads + 1;
+  int64_t start = 0, task_bases = 0;
+  for (int64_t i = 0; i < (int64_t)block.seqs.size(); i++) {
+    task_bases += block.seqs[i].len;
+    if (task_bases < bases_per_task && i + 1 < (int64_t)block.seqs.size()) continue;
+    auto block_supermers = &state->task_supermers[state->task_futs.size()];
+    state->task_futs.push_back(execute_in_thread_pool([&block, start, end = i + 1, dht, block_supermers] {
+      extract_block_supermers(block, start, end, *dht, *block_supermers);
+    }));
+    start = i + 1;
+    task_bases = 0;
+  }
+}
+
+template <int MAX_K>
+static void add_to_block(SeqBlockInserter<MAX_K> *sbi, SeqBlock::BlockSeq block_seq, dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  auto state = sbi->state;
+  state->block.seqs.push_back(block_seq);
+  state->block.num_bases += block_seq.len;
+  if (state->block.num_bases >= KCOUNT_SEQ_BLOCK_SIZE) process_block(sbi, kmer_dht);
+}
+
+template <int MAX_K>
+void SeqBlockInserter<MAX_K>::process_seq(string &seq, kmer_count_t depth, dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  if (state->num_threads) {
+    add_to_block(this, {.offset = (int64_t)state->block.unpacked_seqs.length(), .len = (int)seq.length(), .packed_seq = {},
+                        .depth = depth}, kmer_dht);
+    state->block.unpacked_seqs += seq;
+    return;
   }
-  if (supermer.seq.length() >= kmer_len + 2) {
-    state->bytes_supermers_sent += supermer.get_bytes();
-    kmer_dht->add_supermer(supermer, prev_target_rank);
+  Kmer<MAX_K>::get_kmers(Kmer<MAX_K>::get_k(), seq, state->kmers);
+  send_supermers(this, seq.length(), depth, kmer_dht, [&seq](Supermer &supermer, int start, int len) {
+    supermer.pack(string_view(seq).substr(start, len));
+  });
+}
+
+template <int MAX_K>
+bool SeqBlockInserter<MAX_K>::supports_packed_seqs() {
+  return true;
+}
+
+template <int MAX_K>
+void SeqBlockInserter<MAX_K>::process_packed_seq(const PackedSupermerView &packed_seq, kmer_count_t depth,
+                                                 dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  if (state->num_threads) {
+    add_to_block(this, {.offset = -1, .len = packed_seq.len, .packed_seq = packed_seq, .depth = depth}, kmer_dht);
+    return;
   }
-  state->num_kmers += seq.length() - 2 - kmer_len;
+  Kmer<MAX_K>::get_kmers_from_packed(Kmer<MAX_K>::get_k(), packed_seq.bases, packed_seq.len, state->kmers);
+  send_supermers(this, packed_seq.len, depth, kmer_dht, [&packed_seq](Supermer &supermer, int start, int len) {
+    supermer.pack(packed_seq, start, len);
+  });
 }
 
 template <int MAX_K>
 void SeqBlockInserter<MAX_K>::done_processing(dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  if (state->num_threads) {
+    // the last block is started and then sent
+    process_block(this, kmer_dht);
+    send_block_supermers(this, kmer_dht);
+    auto all_num_blocks = reduce_one(state->num_blocks, op_fast_add, 0).wait();
+    auto all_num_block_waits = reduce_one(state->num_block_waits, op_fast_add, 0).wait();
+    SLOG_CPU_HT("Extracted the supermers of ", all_num_blocks, " blocks with ", state->num_threads, " threads per rank, ",
+                all_num_block_waits, " progress calls waiting for them\n");
+  }
   auto tot_supermers_bytes_sent = reduce_one(state->bytes_supermers_sent, op_fast_add, 0).wait();
   auto tot_kmers_bytes_sent = reduce_one(state->bytes_kmers_sent, op_fast_add, 0).wait();
   SLOG_CPU_HT("Total bytes sent in compressed supermers ", get_size_str(tot_supermers_bytes_sent), " (compression is ", fixed,
               setprecision(3), (double)tot_kmers_bytes_sent / tot_supermers_bytes_sent, " over kmers)\n");
+  auto tot_supermers_bytes_sent_off_node = reduce_one(state->bytes_supermers_sent_off_node, op_fast_add, 0).wait();
+  SLOG_CPU_HT("Supermer bytes sent to other nodes ", perc_str(tot_supermers_bytes_sent_off_node, tot_supermers_bytes_sent), "\n");
   auto all_num_kmers = reduce_one(state->num_kmers, op_fast_add, 0).wait();
   SLOG_CPU_HT("Processed a total of ", all_num_kmers, " kmers\n");
+  auto all_num_supermers = reduce_one(state->num_supermers, op_fast_add, 0).wait();
+  if (all_num_supermers)
+    SLOG_CPU_HT("Sent ", all_num_supermers, " supermers, average length ", fixed, setprecision(2),
+                (double)all_num_kmers / all_num_supermers, " kmers\n");
+  if (kmer_dht->uses_node_first_targets()) {
+    // the tradeoff of node first targets: fewer bytes sent off node, but the supermers can be shorter and more numerous
+    auto all_num_flat_supermers = reduce_one(state->num_flat_supermers, op_fast_add, 0).wait();
+    if (all_num_flat_supermers)
+      SLOG_CPU_HT("Without node first targets there would have been ", all_num_flat_supermers, " supermers, average length ",
+                  fixed, setprecision(2), (double)all_num_kmers / all_num_flat_supermers, " kmers\n");
+  }
 }
 
+// The counts of the extensions on one side of a kmer, as four saturating 13-bit counters packed into the low bits of a word in
+// ACGT order. An extension is only ever chosen by comparing the counters with the dynamic min depth, which can't be more than
+// the counter maximum, so saturating never changes the extension chosen. The high bits are free for the owner.
 struct ExtCounts {
-  kmer_count_t count_A;
-  kmer_count_t count_C;
-  kmer_count_t count_G;
-  kmer_count_t count_T;
-
-  void set(uint16_t *counts) {
-    count_A = counts[0];
-    count_C = counts[1];
-    count_G = counts[2];
-    count_T = counts[3];
-  }
-
-  void set(uint32_t *counts) {
-    count_A = static_cast<uint16_t>(counts[0]);
-    count_C = static_cast<uint16_t>(counts[1]);
-    count_G = static_cast<uint16_t>(counts[2]);
-    count_T = static_cast<uint16_t>(counts[3]);
-  }
-
-  std::array<std::pair<char, int>, 4> get_sorted() {
-    std::array<std::pair<char, int>, 4> counts = {std::make_pair('A', (int)count_A), std::make_pair('C', (int)count_C),
-                                                  std::make_pair('G', (int)count_G), std::make_pair('T', (int)count_T)};
-    std::sort(std::begin(counts), std::end(counts), [](const auto &elem1, const auto &elem2) {
-      if (elem1.second == elem2.second)
-        return elem1.first > elem2.first;
-      else
-        return elem1.second > elem2.second;
-    });
-    return counts;
-  }
+  static constexpr int COUNT_BITS = 13;
+  static constexpr uint64_t COUNT_MAX = (1ULL << COUNT_BITS) - 1;
+  static constexpr int SPARE_SHIFT = 4 * COUNT_BITS;
+  static constexpr uint64_t COUNTS_MASK = (1ULL << SPARE_SHIFT) - 1;
+  static_assert((1.0 - DYN_MIN_DEPTH) * std::numeric_limits<kmer_count_t>::max() <= COUNT_MAX,
+                "the dynamic min depth must not be more than the extension count maximum");
+  static_assert(COUNT_MAX >= 100, "the min depth threshold option must not be more than the extension count maximum");
+  static_assert(COUNT_MAX <= std::numeric_limits<uint16_t>::max(), "the extension counts must fit in the binary kmer tables");
 
-  bool is_zero() {
-    if (count_A + count_C + count_G + count_T == 0) return true;
-    return false;
-  }
+  uint64_t bits;
 
-  kmer_count_t inc_with_limit(int count1, int count2) {
-    count1 += count2;
-    return std::min(count1, (int)std::numeric_limits<kmer_count_t>::max());
-  }
+  int get(int i) const { return (bits >> (i * COUNT_BITS)) & COUNT_MAX; }
 
   void inc(char ext, int count) {
+    int i;
     switch (ext) {
-      case 'A': count_A = inc_with_limit(count_A, count); break;
-      case 'C': count_C = inc_with_limit(count_C, count); break;
-      case 'G': count_G = inc_with_limit(count_G, count); break;
-      case 'T': count_T = inc_with_limit(count_T, count); break;
+      case 'A': i = 0; break;
+      case 'C': i = 1; break;
+      case 'G': i = 2; break;
+      case 'T': i = 3; break;
+      default: return;
     }
+    uint64_t new_count = std::min((uint64_t)get(i) + count, COUNT_MAX);
+    bits = (bits & ~(COUNT_MAX << (i * COUNT_BITS))) | (new_count << (i * COUNT_BITS));
   }
 
-  void add(ExtCounts &ext_counts) {
-    count_A = inc_with_limit(count_A, ext_counts.count_A);
-    count_C = inc_with_limit(count_C, ext_counts.count_C);
-    count_G = inc_with_limit(count_G, ext_counts.count_G);
-    count_T = inc_with_limit(count_T, ext_counts.count_T);
-  }
+  bool is_zero() const { return !(bits & COUNTS_MASK); }
 
-  char get_ext(kmer_count_t count) {
-    auto sorted_counts = get_sorted();
-    int top_count = sorted_counts[0].second;
-    int runner_up_count = sorted_counts[1].second;
-    // set dynamic_min_depth to 1.0 for single depth data (non-metagenomes)
-    int dmin_dyn = std::max((int)((1.0 - DYN_MIN_DEPTH) * count), _dmin_thres);
-    if (top_count < dmin_dyn) return 'X';
-    if (runner_up_count >= dmin_dyn) return 'F';
-    return sorted_counts[0].first;
+  char get_ext(kmer_count_t count) const {
+    int ext_counts[4] = {get(0), get(1), get(2), get(3)};
+    return choose_ext(ext_counts, count);
   }
 
-  string to_string() {
+  string to_string() const {
     ostringstream os;
-    os << count_A << "," << count_C << "," << count_G << "," << count_T;
+    os << get(0) << "," << get(1) << "," << get(2) << "," << get(3);
     return os.str();
   }
 };
 
+// 16 bytes: the count and the contig flag are kept in the spare bits of the extension counts
 struct KmerExtsCounts {
   ExtCounts left_exts;
   ExtCounts right_exts;
-  kmer_count_t count;
-  bool from_ctg;
 
-  char get_left_ext() { return left_exts.get_ext(count); }
+  static constexpr int COUNT_LOW_BITS = 64 - ExtCounts::SPARE_SHIFT;
+  static constexpr uint64_t FROM_CTG_BIT = 1ULL << 63;
+
+  kmer_count_t get_count() const {
+    return (left_exts.bits >> ExtCounts::SPARE_SHIFT) |
+           (((right_exts.bits >> ExtCounts::SPARE_SHIFT) << COUNT_LOW_BITS) & std::numeric_limits<kmer_count_t>::max());
+  }
+
+  void set_count(kmer_count_t count) {
+    left_exts.bits = (left_exts.bits & ExtCounts::COUNTS_MASK) | ((uint64_t)count << ExtCounts::SPARE_SHIFT);
+    right_exts.bits = (right_exts.bits & (ExtCounts::COUNTS_MASK | FROM_CTG_BIT)) |
+                      ((uint64_t)(count >> COUNT_LOW_BITS) << ExtCounts::SPARE_SHIFT);
+  }
 
-  char get_right_ext() { return right_exts.get_ext(count); }
+  bool is_from_ctg() const { return right_exts.bits & FROM_CTG_BIT; }
+
+  // clears the counts
+  void reset(kmer_count_t count, bool from_ctg) {
+    left_exts.bits = 0;
+    right_exts.bits = from_ctg ? FROM_CTG_BIT : 0;
+    set_count(count);
+  }
+
+  // adds an occurrence of the kmer, saturating the count
+  void add(kmer_count_t count, char left_ext, char right_ext) {
+    set_count(std::min((int)get_count() + count, (int)std::numeric_limits<kmer_count_t>::max()));
+    left_exts.inc(left_ext, count);
+    right_exts.inc(right_ext, count);
+  }
+
+  char get_left_ext() const { return left_exts.get_ext(get_count()); }
+
+  char get_right_ext() const { return right_exts.get_ext(get_count()); }
 };
+static_assert(sizeof(KmerExtsCounts) == 16, "the kmer extension counts should be 16 bytes");
 
 // template <int MAX_K>
 // using KmerMapExts = HASH_TABLE<Kmer<MAX_K>, KmerExtsCounts>;
 
+// A view of a kmer table in the shared segment, which all the ranks on a node can insert read kmers into concurrently. Each slot
+// has a state byte: a slot is claimed by swapping its state from empty to locked, and the key is only written while it is locked,
+// so once the slot is full the key never changes and can be compared without the lock. The counts are updated under the lock.
+template <int MAX_K>
+class NodeKmerTable {
+  Kmer<MAX_K> *keys = nullptr;
+  KmerExtsCounts *counts = nullptr;
+  std::atomic<uint8_t> *slot_states = nullptr;
+  size_t capacity = 0;
+
+ public:
+  enum SlotState : uint8_t { SLOT_EMPTY = 0, SLOT_LOCKED = 1, SLOT_FULL = 2 };
+
+  // updated by the rank using the view, not the owner of the table
+  size_t sum_probe_lens = 0;
+  size_t max_probe_len = 0;
+  size_t num_dropped = 0;
+
+  NodeKmerTable() {}
+
+  // the keys, the counts and the slot states are laid out one after the other in the memory
+  NodeKmerTable(uint64_t *mem, size_t capacity)
+      : capacity(capacity) {
+    static_assert(sizeof(std::atomic<uint8_t>) == 1, "the slot states must be single bytes");
+    keys = (Kmer<MAX_K> *)mem;
+    counts = (KmerExtsCounts *)(keys + capacity);
+    slot_states = (std::atomic<uint8_t> *)(counts + capacity);
+  }
+
+  static size_t get_num_words(size_t capacity) {
+    return ((sizeof(Kmer<MAX_K>) + sizeof(KmerExtsCounts) + sizeof(std::atomic<uint8_t>)) * capacity + 7) / 8;
+  }
+
+  void clear() {
+    memset((void *)keys, 0xff, sizeof(Kmer<MAX_K>) * capacity);
+    for (size_t i = 0; i < capacity; i++) new (&slot_states[i]) std::atomic<uint8_t>(SLOT_EMPTY);
+  }
+
+  size_t get_slot(const Kmer<MAX_K> &kmer) { return kmer.hash() % capacity; }
+
+  void prefetch(size_t slot) {
+    __builtin_prefetch(&slot_states[slot]);
+    __builtin_prefetch(&keys[slot]);
+    __builtin_prefetch(&counts[slot], 1);
+  }
+
+  // there is no singleton override here, because that is only used for the ctg kmers, which are inserted by the owner alone
+  void insert(const KmerAndExt<MAX_K> &kmer_and_ext, size_t start_slot) {
+    size_t slot = start_slot;
+    const int MAX_PROBE = (capacity < KCOUNT_HT_MAX_PROBE ? capacity : KCOUNT_HT_MAX_PROBE);
+    for (int i = 1; i <= MAX_PROBE; i++) {
+      auto &slot_state = slot_states[slot];
+      uint8_t state = slot_state.load(std::memory_order_acquire);
+      while (true) {
+        if (state == SLOT_LOCKED) {
+          // another rank is writing this slot, which only takes a few instructions
+          state = slot_state.load(std::memory_order_acquire);
+          continue;
+        }
+        if (state == SLOT_FULL && keys[slot] != kmer_and_ext.kmer) break;
+        // on failure the current state is loaded and checked again
+        if (!slot_state.compare_exchange_weak(state, SLOT_LOCKED, std::memory_order_acquire)) continue;
+        if (state == SLOT_EMPTY) {
+          keys[slot] = kmer_and_ext.kmer;
+          counts[slot].reset(0, false);
+          sum_probe_lens += i;
+          if (i > max_probe_len) max_probe_len = i;
+        }
+        counts[slot].add(kmer_and_ext.count, kmer_and_ext.left, kmer_and_ext.right);
+        slot_state.store(SLOT_FULL, std::memory_order_release);
+        return;
+      }
+      slot = (slot + 1) % capacity;
+    }
+    num_dropped++;
+  }
+};
+
+// the location of a table in the shared segment, exchanged between the ranks on a node
+struct NodeKmerTableLocation {
+  global_ptr<uint64_t> mem;
+  size_t capacity;
+};
+
 template <int MAX_K>
 class KmerMapExts {
   size_t capacity = 0;
   size_t num_elems = 0;
   size_t num_dropped = 0;
   size_t num_singleton_overrides = 0;
-  vector<Kmer<MAX_K>> keys;
+  // both arrays are views of buffers from the table memory pool, which outlive the table, or of the shared segment memory
+  Kmer<MAX_K> *keys = nullptr;
   size_t sum_probe_lens = 0;
   size_t max_probe_len = 0;
-  vector<KmerExtsCounts> counts;
+  KmerExtsCounts *counts = nullptr;
   int iter_pos = 0;
   const int N_LONGS = Kmer<MAX_K>::get_N_LONGS();
   const uint64_t KEY_EMPTY = 0xffffffffffffffff;
+  // set when the table is in the shared segment, so that the other ranks on the node can insert into it
+  global_ptr<uint64_t> shared_mem;
+  // the capacity that the buffers from the pool were acquired for
+  size_t pooled_capacity = 0;
 
  public:
+  ~KmerMapExts() {
+    if (shared_mem) {
+      upcxx::deallocate(shared_mem);
+      return;
+    }
+    if (keys) _table_mem_pool.release(TableMemPool::KMER_KEYS);
+    if (counts) _table_mem_pool.release(TableMemPool::KMER_COUNTS);
+  }
+
+  // returns false if the shared segment doesn't have enough space left for the table
+  bool reserve_shared(size_t max_elems) {
+    primes::Prime prime;
+    prime.set(max_elems, true);
+    capacity = prime.get();
+    num_elems = 0;
+    shared_mem = upcxx::allocate<uint64_t>(NodeKmerTable<MAX_K>::get_num_words(capacity));
+    if (!shared_mem) return false;
+    SLOG_CPU_HT("Capacity is set to ", capacity, " for ", max_elems, " max elements in the shared segment\n");
+    auto node_table = get_node_table();
+    node_table.clear();
+    keys = (Kmer<MAX_K> *)shared_mem.local();
+    counts = (KmerExtsCounts *)(keys + capacity);
+    return true;
+  }
+
+  void release_shared() {
+    if (shared_mem) upcxx::deallocate(shared_mem);
+    shared_mem = nullptr;
+    keys = nullptr;
+    counts = nullptr;
+  }
+
+  NodeKmerTableLocation get_node_table_location() { return {shared_mem, capacity}; }
+
+  NodeKmerTable<MAX_K> get_node_table() { return NodeKmerTable<MAX_K>(shared_mem.local(), capacity); }
+
+  // the inserts by the ranks on the node are not counted here, so this is done once they have all finished
+  void recount_elems() {
+    num_elems = 0;
+    for (size_t i = 0; i < capacity; i++) {
+      if (keys[i].get_longs()[N_LONGS - 1] != KEY_EMPTY) num_elems++;
+    }
+  }
+
+  void add_insert_stats(size_t sum_probe_lens, size_t max_probe_len, size_t num_dropped) {
+    this->sum_probe_lens += sum_probe_lens;
+    this->max_probe_len = max(this->max_probe_len, max_probe_len);
+    this->num_dropped += num_dropped;
+  }
+
   void reserve(size_t max_elems) {
     primes::Prime prime;
     prime.set(max_elems, true);
     capacity = prime.get();
     SLOG_CPU_HT("Capacity is set to ", capacity, " for ", max_elems, " max elements\n");
     num_elems = 0;
-    keys.resize(capacity);
-    memset((void *)keys.data(), 0xff, sizeof(Kmer<MAX_K>) * capacity);
-    counts.resize(capacity, {0});
+    if (shared_mem) DIE("Cannot reserve a table in the shared segment again");
+    // a larger table needs larger buffers, so the ones acquired before are given back to the pool first
+    if (keys && capacity > pooled_capacity) {
+      _table_mem_pool.release(TableMemPool::KMER_KEYS);
+      _table_mem_pool.release(TableMemPool::KMER_COUNTS);
+      keys = nullptr;
+      counts = nullptr;
+    }
+    if (!keys) {
+      keys = (Kmer<MAX_K> *)_table_mem_pool.acquire(TableMemPool::KMER_KEYS, sizeof(Kmer<MAX_K>) * capacity);
+      // the counts are only zeroed when a kmer is first inserted into a slot, so the memory left from earlier rounds isn't touched
+      counts = (KmerExtsCounts *)_table_mem_pool.acquire(TableMemPool::KMER_COUNTS, sizeof(KmerExtsCounts) * capacity);
+      pooled_capacity = capacity;
+    }
+    memset((void *)keys, 0xff, sizeof(Kmer<MAX_K>) * capacity);
+  }
+
+  size_t get_slot(const Kmer<MAX_K> &kmer) { return kmer.hash() % capacity; }
+
+  void prefetch(size_t slot) {
+    __builtin_prefetch(&keys[slot]);
+    __builtin_prefetch(&counts[slot], 1);
   }
 
   pair<KmerExtsCounts *, bool> insert(const Kmer<MAX_K> &kmer, bool override_singletons) {
-    int slot = kmer.hash() % capacity;
-    int start_slot = slot;
+    return insert(kmer, get_slot(kmer), override_singletons);
+  }
+
+  // insert with a slot already computed by get_slot
+  pair<KmerExtsCounts *, bool> insert(const Kmer<MAX_K> &kmer, size_t start_slot, bool override_singletons) {
+    size_t slot = start_slot;
     const int MAX_PROBE = (capacity < KCOUNT_HT_MAX_PROBE ? capacity : KCOUNT_HT_MAX_PROBE);
     for (int i = 1; i <= MAX_PROBE; i++) {
       if (keys[slot].get_longs()[N_LONGS - 1] == KEY_EMPTY) {
         keys[slot] = kmer;
+        counts[slot].reset(0, false);
         sum_probe_lens += i;
         if (i > max_probe_len) max_probe_len = i;
         num_elems++;
@@ -252,7 +652,7 @@ class KmerMapExts {
       slot = start_slot;
       for (int i = 1; i <= MAX_PROBE; i++) {
         assert(kmer != keys[slot]); // FIXME? probe_lens[slot] != 0
-        if (counts[slot].count == 1) {
+        if (counts[slot].get_count() == 1) {
           num_singleton_overrides++;
           keys[slot] = kmer;
           if (i > max_probe_len) max_probe_len = i;
@@ -304,24 +704,20 @@ class KmerMapExts {
 // that the keys is 2x the non-keys, then we cannot save more than those fractions, even for higher singleton counts. eg if we
 // have 80% singletons we'll still get 44% and 25% savings.
 
+// the buffers are reused across calls to avoid allocations for every supermer
 template <int MAX_K>
-static void get_kmers_and_exts(Supermer &supermer, vector<KmerAndExt<MAX_K>> &kmers_and_exts) {
-  vector<bool> quals;
-  quals.resize(supermer.seq.length());
-  for (int i = 0; i < supermer.seq.length(); i++) {
-    quals[i] = isupper(supermer.seq[i]);
-    supermer.seq[i] = toupper(supermer.seq[i]);
-  }
+static void get_kmers_and_exts(const SupermerChunk<MAX_K> &supermer, vector<Kmer<MAX_K>> &kmers,
+                               vector<KmerAndExt<MAX_K>> &kmers_and_exts) {
+  // the kmers are decoded directly from the packed bases, and only good quality bases are used as extensions
   auto kmer_len = Kmer<MAX_K>::get_k();
-  vector<Kmer<MAX_K>> kmers;
-  Kmer<MAX_K>::get_kmers(kmer_len, supermer.seq, kmers);
+  auto packed = supermer.get_packed_view();
+  if (packed.len < kmer_len + 2) DIE("Packed supermer is too short for any kmers with extensions: ", packed.len);
+  Kmer<MAX_K>::get_kmers_from_packed(kmer_len, packed.bases, packed.len, kmers);
   kmers_and_exts.clear();
-  for (int i = 1; i < (int)(supermer.seq.length() - kmer_len); i++) {
+  for (int i = 1; i < (int)(packed.len - kmer_len); i++) {
     Kmer<MAX_K> kmer = kmers[i];
-    char left_ext = supermer.seq[i - 1];
-    if (!quals[i - 1]) left_ext = '0';
-    char right_ext = supermer.seq[i + kmer_len];
-    if (!quals[i + kmer_len]) right_ext = '0';
+    char left_ext = packed.is_good_qual(i - 1) ? packed.get_base(i - 1) : '0';
+    char right_ext = packed.is_good_qual(i + kmer_len) ? packed.get_base(i + kmer_len) : '0';
     // get the lexicographically smallest
     Kmer<MAX_K> kmer_rc = kmer.revcomp();
     if (kmer_rc < kmer) {
@@ -334,81 +730,398 @@ static void get_kmers_and_exts(Supermer &supermer, vector<KmerAndExt<MAX_K>> &km
   }
 }
 
+// how many kmers ahead of the current insert to prefetch the hash table slots
+static const int INSERT_PREFETCH_DIST = 16;
+
+// hash all the kmers first, so that their slots can be prefetched well before they are probed
 template <int MAX_K>
-static void insert_supermer_from_read(Supermer &supermer, dist_object<KmerMapExts<MAX_K>> &kmers) {
-  auto kmer_len = Kmer<MAX_K>::get_k();
-  vector<KmerAndExt<MAX_K>> kmers_and_exts;
-  kmers_and_exts.reserve(supermer.seq.length() - kmer_len);
-  get_kmers_and_exts(supermer, kmers_and_exts);
-  for (auto &kmer_and_ext : kmers_and_exts) {
+static void get_slots(vector<KmerAndExt<MAX_K>> &kmers_and_exts, vector<size_t> &slots, dist_object<KmerMapExts<MAX_K>> &kmers) {
+  slots.resize(kmers_and_exts.size());
+  for (size_t i = 0; i < kmers_and_exts.size(); i++) slots[i] = kmers->get_slot(kmers_and_exts[i].kmer);
+  for (size_t i = 0; i < slots.size() && i < INSERT_PREFETCH_DIST; i++) kmers->prefetch(slots[i]);
+}
+
+template <int MAX_K>
+static void insert_kmers_from_read(vector<KmerAndExt<MAX_K>> &kmers_and_exts, vector<size_t> &slots,
+                                   dist_object<KmerMapExts<MAX_K>> &kmers) {
+  get_slots(kmers_and_exts, slots, kmers);
+  for (size_t i = 0; i < kmers_and_exts.size(); i++) {
+    if (i + INSERT_PREFETCH_DIST < slots.size()) kmers->prefetch(slots[i + INSERT_PREFETCH_DIST]);
+    auto &kmer_and_ext = kmers_and_exts[i];
     // find it - if it isn't found then insert it - this doen't set or change the value
-    auto [exts_counts, is_new] = kmers->insert(kmer_and_ext.kmer, false);
+    auto [exts_counts, is_new] = kmers->insert(kmer_and_ext.kmer, slots[i], false);
     // no space - had to drop it
     if (!exts_counts) continue;
-    int count = exts_counts->count + kmer_and_ext.count;
-    if (count > numeric_limits<kmer_count_t>::max()) count = numeric_limits<kmer_count_t>::max();
-    exts_counts->count = count;
-    exts_counts->left_exts.inc(kmer_and_ext.left, kmer_and_ext.count);
-    exts_counts->right_exts.inc(kmer_and_ext.right, kmer_and_ext.count);
+    exts_counts->add(kmer_and_ext.count, kmer_and_ext.left, kmer_and_ext.right);
   }
 }
 
+// update an entry with a kmer derived from the previous round's contigs
 template <int MAX_K>
-static void insert_supermer_from_ctg(Supermer &supermer, dist_object<KmerMapExts<MAX_K>> &kmers) {
-  auto kmer_len = Kmer<MAX_K>::get_k();
-  vector<KmerAndExt<MAX_K>> kmers_and_exts;
-  kmers_and_exts.reserve(supermer.seq.length() - kmer_len);
-  get_kmers_and_exts(supermer, kmers_and_exts);
-  for (auto &kmer_and_ext : kmers_and_exts) {
+static void update_ctg_kmer(KmerExtsCounts *exts_counts, bool is_new, KmerAndExt<MAX_K> &kmer_and_ext) {
+  bool insert_it = false;
+  if (is_new) {
+    insert_it = true;
+  } else if (!exts_counts->is_from_ctg()) {
+    // existing entry is from a read
+    if (exts_counts->get_count() == 1) {
+      // singleton read kmer, replace - this will just be purged anyway
+      insert_it = true;
+    } else {
+      char left_ext = exts_counts->get_left_ext();
+      char right_ext = exts_counts->get_right_ext();
+      // non-UU, replace
+      if (left_ext == 'X' || left_ext == 'F' || right_ext == 'X' || right_ext == 'F') insert_it = true;
+    }
+  } else {
+    // existing entry from contig
+    if (exts_counts->get_count()) {
+      // will always insert, although it may get purged later for a conflict
+      insert_it = true;
+      char left_ext = exts_counts->get_left_ext();
+      char right_ext = exts_counts->get_right_ext();
+      if (left_ext != kmer_and_ext.left || right_ext != kmer_and_ext.right) {
+        // if the two contig kmers disagree on extensions, set up to purge by setting the count to 0
+        kmer_and_ext.count = 0;
+      } else {
+        // multiple occurrences of the same kmer derived from different contigs or parts of contigs
+        // The only way this kmer could have been already found in the contigs only is if it came from a localassm
+        // extension. In which case, all such kmers should not be counted again for each contig, because each
+        // contig can use the same reads independently, and the depth will be oversampled.
+        kmer_and_ext.count = min(kmer_and_ext.count, exts_counts->get_count());
+      }
+    }
+  }
+  if (insert_it) {
+    exts_counts->reset(0, true);
+    exts_counts->add(kmer_and_ext.count, kmer_and_ext.left, kmer_and_ext.right);
+  }
+}
+
+template <int MAX_K>
+static void insert_kmers_into_node_table(vector<KmerAndExt<MAX_K>> &kmers_and_exts, vector<size_t> &slots,
+                                         NodeKmerTable<MAX_K> &node_table) {
+  slots.resize(kmers_and_exts.size());
+  for (size_t i = 0; i < kmers_and_exts.size(); i++) slots[i] = node_table.get_slot(kmers_and_exts[i].kmer);
+  for (size_t i = 0; i < slots.size() && i < INSERT_PREFETCH_DIST; i++) node_table.prefetch(slots[i]);
+  for (size_t i = 0; i < kmers_and_exts.size(); i++) {
+    if (i + INSERT_PREFETCH_DIST < slots.size()) node_table.prefetch(slots[i + INSERT_PREFETCH_DIST]);
+    node_table.insert(kmers_and_exts[i], slots[i]);
+  }
+}
+
+template <int MAX_K>
+static void insert_kmers_from_ctg(vector<KmerAndExt<MAX_K>> &kmers_and_exts, vector<size_t> &slots,
+                                  dist_object<KmerMapExts<MAX_K>> &kmers) {
+  get_slots(kmers_and_exts, slots, kmers);
+  for (size_t i = 0; i < kmers_and_exts.size(); i++) {
+    if (i + INSERT_PREFETCH_DIST < slots.size()) kmers->prefetch(slots[i + INSERT_PREFETCH_DIST]);
+    auto &kmer_and_ext = kmers_and_exts[i];
     // insert a new kmer derived from the previous round's contigs
-    auto [exts_counts, is_new] = kmers->insert(kmer_and_ext.kmer, true);
+    auto [exts_counts, is_new] = kmers->insert(kmer_and_ext.kmer, slots[i], true);
     // no space - had to drop it
     if (!exts_counts) continue;
-    bool insert_it = false;
-    if (is_new) {
-      insert_it = true;
-    } else if (!exts_counts->from_ctg) {
-      // existing entry is from a read
-      if (exts_counts->count == 1) {
-        // singleton read kmer, replace - this will just be purged anyway
-        insert_it = true;
-      } else {
-        char left_ext = exts_counts->get_left_ext();
-        char right_ext = exts_counts->get_right_ext();
-        // non-UU, replace
-        if (left_ext == 'X' || left_ext == 'F' || right_ext == 'X' || right_ext == 'F') insert_it = true;
+    update_ctg_kmer(exts_counts, is_new, kmer_and_ext);
+  }
+}
+
+// Counts kmers by appending every occurrence to a buffer, which is radix sorted by kmer and run-length reduced into a sorted
+// array of distinct kmers whenever it fills up. There is no random probing, and no kmers are ever dropped.
+template <int MAX_K>
+class KmerSortedExts {
+  vector<KmerAndExt<MAX_K>> buf;
+  vector<KmerAndExt<MAX_K>> tmp_buf;
+  size_t buf_capacity = 0;
+  vector<Kmer<MAX_K>> keys;
+  vector<KmerExtsCounts> counts;
+  size_t num_sorts = 0;
+  size_t num_occurrences = 0;
+  size_t iter_pos = 0;
+  const int N_LONGS = Kmer<MAX_K>::get_N_LONGS();
+
+  // the order produced by the radix sort: the longs are compared from the last to the first
+  bool kmer_less(const Kmer<MAX_K> &kmer1, const Kmer<MAX_K> &kmer2) const {
+    auto longs1 = kmer1.get_longs();
+    auto longs2 = kmer2.get_longs();
+    for (int l = N_LONGS - 1; l >= 0; l--) {
+      if (longs1[l] != longs2[l]) return longs1[l] < longs2[l];
+    }
+    return false;
+  }
+
+  // stable LSD radix sort on 8-bit digits, skipping any digit that is the same for all the elements
+  void radix_sort(vector<KmerAndExt<MAX_K>> &elems) {
+    const int num_digits = N_LONGS * 8;
+    vector<array<size_t, 256>> hists(num_digits);
+    for (auto &hist : hists) hist.fill(0);
+    for (auto &elem : elems) {
+      auto longs = elem.kmer.get_longs();
+      for (int d = 0; d < num_digits; d++) hists[d][(longs[d / 8] >> (8 * (d % 8))) & 0xff]++;
+    }
+    tmp_buf.resize(elems.size());
+    for (int d = 0; d < num_digits; d++) {
+      auto &hist = hists[d];
+      if (*max_element(hist.begin(), hist.end()) == elems.size()) continue;
+      array<size_t, 256> offsets;
+      size_t offset = 0;
+      for (int i = 0; i < 256; i++) {
+        offsets[i] = offset;
+        offset += hist[i];
       }
-    } else {
-      // existing entry from contig
-      if (exts_counts->count) {
-        // will always insert, although it may get purged later for a conflict
-        insert_it = true;
-        char left_ext = exts_counts->get_left_ext();
-        char right_ext = exts_counts->get_right_ext();
-        if (left_ext != kmer_and_ext.left || right_ext != kmer_and_ext.right) {
-          // if the two contig kmers disagree on extensions, set up to purge by setting the count to 0
-          kmer_and_ext.count = 0;
-        } else {
-          // multiple occurrences of the same kmer derived from different contigs or parts of contigs
-          // The only way this kmer could have been already found in the contigs only is if it came from a localassm
-          // extension. In which case, all such kmers should not be counted again for each contig, because each
-          // contig can use the same reads independently, and the depth will be oversampled.
-          kmer_and_ext.count = min(kmer_and_ext.count, exts_counts->count);
-        }
+      for (auto &elem : elems) tmp_buf[offsets[(elem.kmer.get_longs()[d / 8] >> (8 * (d % 8))) & 0xff]++] = elem;
+      elems.swap(tmp_buf);
+    }
+  }
+
+  static void add_occurrence(KmerExtsCounts &exts_counts, const KmerAndExt<MAX_K> &kmer_and_ext) {
+    exts_counts.add(kmer_and_ext.count, kmer_and_ext.left, kmer_and_ext.right);
+  }
+
+ public:
+  void reserve(size_t max_buf_elems) {
+    buf_capacity = max_buf_elems;
+    SLOG_CPU_HT("Sort buffer capacity is set to ", buf_capacity, " kmers\n");
+    buf.reserve(buf_capacity);
+    tmp_buf.reserve(buf_capacity);
+  }
+
+  void add(const KmerAndExt<MAX_K> &kmer_and_ext) {
+    buf.push_back(kmer_and_ext);
+    if (buf.size() >= buf_capacity) sort_and_reduce();
+  }
+
+  // sort the buffered read kmers and merge them into the array of distinct kmers
+  void sort_and_reduce() {
+    if (buf.empty()) return;
+    num_sorts++;
+    num_occurrences += buf.size();
+    radix_sort(buf);
+    vector<Kmer<MAX_K>> new_keys;
+    vector<KmerExtsCounts> new_counts;
+    new_keys.reserve(keys.size() + buf.size() / 2);
+    new_counts.reserve(keys.size() + buf.size() / 2);
+    size_t i = 0, j = 0;
+    while (i < buf.size()) {
+      // copy across existing kmers that come before the next run
+      for (; j < keys.size() && kmer_less(keys[j], buf[i].kmer); j++) {
+        new_keys.push_back(keys[j]);
+        new_counts.push_back(counts[j]);
+      }
+      new_keys.push_back(buf[i].kmer);
+      new_counts.push_back({});
+      new_counts.back().reset(0, false);
+      auto &exts_counts = new_counts.back();
+      if (j < keys.size() && keys[j] == buf[i].kmer) {
+        exts_counts = counts[j];
+        j++;
       }
+      for (; i < buf.size() && buf[i].kmer == new_keys.back(); i++) add_occurrence(exts_counts, buf[i]);
     }
-    if (insert_it) {
-      *exts_counts = {.left_exts = {0}, .right_exts = {0}, .count = kmer_and_ext.count, .from_ctg = true};
-      exts_counts->left_exts.inc(kmer_and_ext.left, kmer_and_ext.count);
-      exts_counts->right_exts.inc(kmer_and_ext.right, kmer_and_ext.count);
+    for (; j < keys.size(); j++) {
+      new_keys.push_back(keys[j]);
+      new_counts.push_back(counts[j]);
     }
+    keys.swap(new_keys);
+    counts.swap(new_counts);
+    buf.clear();
   }
-}
+
+  // apply kmers from contigs in the order they were received, with the same rules as the hash table inserts
+  void merge_ctg_kmers(vector<KmerAndExt<MAX_K>> &ctg_kmers_and_exts) {
+    if (ctg_kmers_and_exts.empty()) return;
+    radix_sort(ctg_kmers_and_exts);
+    vector<Kmer<MAX_K>> new_keys;
+    vector<KmerExtsCounts> new_counts;
+    new_keys.reserve(keys.size() + ctg_kmers_and_exts.size());
+    new_counts.reserve(keys.size() + ctg_kmers_and_exts.size());
+    size_t i = 0, j = 0;
+    while (i < ctg_kmers_and_exts.size()) {
+      for (; j < keys.size() && kmer_less(keys[j], ctg_kmers_and_exts[i].kmer); j++) {
+        new_keys.push_back(keys[j]);
+        new_counts.push_back(counts[j]);
+      }
+      new_keys.push_back(ctg_kmers_and_exts[i].kmer);
+      new_counts.push_back({});
+      new_counts.back().reset(0, false);
+      auto &exts_counts = new_counts.back();
+      bool is_new = true;
+      if (j < keys.size() && keys[j] == ctg_kmers_and_exts[i].kmer) {
+        exts_counts = counts[j];
+        is_new = false;
+        j++;
+      }
+      for (; i < ctg_kmers_and_exts.size() && ctg_kmers_and_exts[i].kmer == new_keys.back(); i++) {
+        update_ctg_kmer(&exts_counts, is_new, ctg_kmers_and_exts[i]);
+        is_new = false;
+      }
+    }
+    for (; j < keys.size(); j++) {
+      new_keys.push_back(keys[j]);
+      new_counts.push_back(counts[j]);
+    }
+    keys.swap(new_keys);
+    counts.swap(new_counts);
+    ctg_kmers_and_exts.clear();
+  }
+
+  size_t size() { return keys.size(); }
+
+  size_t get_num_sorts() { return num_sorts; }
+
+  size_t get_num_occurrences() { return num_occurrences; }
+
+  void begin_iterate() { iter_pos = 0; }
+
+  pair<Kmer<MAX_K> *, KmerExtsCounts *> get_next() {
+    if (iter_pos >= keys.size()) return {nullptr, nullptr};
+    iter_pos++;
+    return {&keys[iter_pos - 1], &counts[iter_pos - 1]};
+  }
+};
+
+// The supermers received for each kmer partition, spilled as their variable length records to one file per partition for the reads
+// and another for the ctgs, so that a partition can be counted later in the same way as the whole table, with the ctg kmers
+// applied after the reads.
+template <int MAX_K>
+class KmerPartitionSpills {
+  struct Spill {
+    string fname;
+    ofstream file;
+    vector<uint8_t> buf;
+    int64_t num_kmers = 0;
+  };
+  vector<Spill> read_spills;
+  vector<Spill> ctg_spills;
+  int64_t bytes_spilled = 0;
+  // bytes of records buffered per spill before they are written
+  static const int BUF_BYTES = 32 * 1024;
+  static_assert(BUF_BYTES >= SupermerChunk<MAX_K>::MAX_RECORD_BYTES, "the spill buffer must hold the longest record");
+
+  void open_spills(vector<Spill> &spills, int num_partitions, const string &spill_dir, const string &kind) {
+    spills.resize(num_partitions);
+    for (int i = 0; i < spills.size(); i++) {
+      auto &spill = spills[i];
+      spill.fname = "kmer-spill-" + to_string(Kmer<MAX_K>::get_k()) + "-" + kind + "-" + to_string(i) + ".bin";
+      if (spill_dir.empty())
+        get_rank_path(spill.fname, rank_me());
+      else
+        spill.fname = spill_dir + "/" + to_string(rank_me()) + "-" + spill.fname;
+      spill.file.open(spill.fname, ios::binary | ios::trunc);
+      if (!spill.file) DIE("Could not open ", spill.fname, " for spilling kmers: ", strerror(errno));
+      spill.buf.reserve(BUF_BYTES + SupermerChunk<MAX_K>::MAX_RECORD_BYTES);
+    }
+  }
+
+  void write_buf(Spill &spill) {
+    if (spill.buf.empty()) return;
+    spill.file.write((const char *)spill.buf.data(), spill.buf.size());
+    if (!spill.file) DIE("Could not write to ", spill.fname, ": ", strerror(errno));
+    bytes_spilled += spill.buf.size();
+    spill.buf.clear();
+  }
+
+  Spill &get_spill(int partition, bool from_ctg) { return from_ctg ? ctg_spills[partition] : read_spills[partition]; }
+
+ public:
+  ~KmerPartitionSpills() {
+    for (auto spills : {&read_spills, &ctg_spills}) {
+      for (auto &spill : *spills) {
+        if (spill.fname.empty()) continue;
+        spill.file.close();
+        unlink(spill.fname.c_str());
+      }
+    }
+  }
+
+  void init(int num_partitions, const string &spill_dir) {
+    open_spills(read_spills, num_partitions, spill_dir, "reads");
+    open_spills(ctg_spills, num_partitions, spill_dir, "ctgs");
+  }
+
+  int get_num_partitions() { return read_spills.size(); }
+
+  int64_t get_bytes_spilled() { return bytes_spilled; }
+
+  int64_t get_num_kmers(int partition, bool from_ctg) { return get_spill(partition, from_ctg).num_kmers; }
+
+  void add(const SupermerChunk<MAX_K> &supermer, int partition, bool from_ctg) {
+    auto &spill = get_spill(partition, from_ctg);
+    auto pos = spill.buf.size();
+    spill.buf.resize(pos + supermer.get_record_bytes(supermer.len));
+    supermer.write_record(spill.buf.data() + pos);
+    // the len of the chunk is in bytes; the kmers inserted from it are those with a base on either side
+    spill.num_kmers += supermer.get_packed_view().len - Kmer<MAX_K>::get_k() - 1;
+    if (spill.buf.size() >= BUF_BYTES) write_buf(spill);
+  }
+
+  void flush() {
+    for (auto spills : {&read_spills, &ctg_spills}) {
+      for (auto &spill : *spills) {
+        write_buf(spill);
+        spill.file.flush();
+      }
+    }
+  }
+
+  // passes every supermer in the spill to process_supermer, and then deletes the spill
+  template <typename ProcessFunc>
+  void read(int partition, bool from_ctg, ProcessFunc process_supermer) {
+    auto &spill = get_spill(partition, from_ctg);
+    write_buf(spill);
+    spill.file.close();
+    ifstream file(spill.fname, ios::binary);
+    if (!file) DIE("Could not open ", spill.fname, " for reading spilled kmers: ", strerror(errno));
+    vector<uint8_t> buf(BUF_BYTES);
+    SupermerChunk<MAX_K> supermer;
+    int64_t buf_len = 0;
+    while (file) {
+      file.read((char *)buf.data() + buf_len, BUF_BYTES - buf_len);
+      buf_len += file.gcount();
+      // a record that is cut off at the end of the buffer is carried over to the next read
+      int64_t pos = 0;
+      while (pos + SupermerChunk<MAX_K>::RECORD_HEADER_BYTES <= buf_len &&
+             pos + SupermerChunk<MAX_K>::peek_record_bytes(buf.data() + pos) <= buf_len) {
+        pos += supermer.read_record(buf.data() + pos);
+        process_supermer(supermer);
+      }
+      memmove(buf.data(), buf.data() + pos, buf_len - pos);
+      buf_len -= pos;
+    }
+    if (!file.eof()) DIE("Could not read ", spill.fname, ": ", strerror(errno));
+    if (buf_len) DIE("Truncated supermer record at the end of ", spill.fname);
+    unlink(spill.fname.c_str());
+    spill.fname.clear();
+    vector<uint8_t>().swap(spill.buf);
+  }
+};
 
 template <int MAX_K>
 struct HashTableInserter<MAX_K>::HashTableInserterState {
   bool using_ctg_kmers = false;
+  bool use_sort_kcount = false;
   dist_object<KmerMapExts<MAX_K>> kmers;
+  KmerSortedExts<MAX_K> sorted_kmers;
+  // reused for every supermer
+  vector<Kmer<MAX_K>> kmers_buf;
+  vector<KmerAndExt<MAX_K>> kmers_and_exts;
+  vector<size_t> slots;
+  vector<KmerAndExt<MAX_K>> ctg_kmers_and_exts;
+  // views of the tables of all the ranks on the node, indexed by the local team rank, when the tables are in the shared segment
+  vector<NodeKmerTable<MAX_K>> node_tables;
+  // the received supermers may be inserted on another thread than the direct inserts into the node tables, so they have their
+  // own view of this rank's table and their own buffers
+  NodeKmerTable<MAX_K> received_node_table;
+  // all the read kmers of a batch of supermers
+  vector<KmerAndExt<MAX_K>> batch_kmers_and_exts;
+  vector<Kmer<MAX_K>> direct_kmers_buf;
+  vector<KmerAndExt<MAX_K>> direct_kmers_and_exts;
+  vector<size_t> direct_slots;
+  // when the kmers are partitioned, the table is only reserved when the partitions are counted, and it is sized from these
+  KmerPartitionSpills<MAX_K> spills;
+  int64_t num_elems = 0;
+  int64_t max_elems = 0;
+  // the kmers dropped from the table in the passes flushed so far, which are missing from the histogram
+  int64_t num_dropped = 0;
 
   HashTableInserterState()
       : kmers({}) {}
@@ -423,10 +1136,46 @@ HashTableInserter<MAX_K>::~HashTableInserter() {
 }
 
 template <int MAX_K>
-void HashTableInserter<MAX_K>::init(int num_elems, bool use_qf) {
+bool HashTableInserter<MAX_K>::supports_host_kmer_targets() {
+  return true;
+}
+
+template <int MAX_K>
+bool HashTableInserter<MAX_K>::has_node_tables() {
+  return state && !state->node_tables.empty();
+}
+
+template <int MAX_K>
+static bool init_node_tables(dist_object<KmerMapExts<MAX_K>> &kmers, size_t max_elems, vector<NodeKmerTable<MAX_K>> &node_tables) {
+  bool allocated = kmers->reserve_shared(max_elems);
+  // every rank has to fall back to its own table if any rank runs out of shared segment, since the kmers are sent to all ranks
+  if (!reduce_all((int)allocated, op_fast_min).wait()) {
+    kmers->release_shared();
+    auto num_failed = reduce_one((int)!allocated, op_fast_add, 0).wait();
+    SWARN("Not enough space in the shared segment on ", num_failed, " processes for the kmer tables, falling back to separate ",
+          "tables; increase the shared heap size to use node shared tables");
+    return false;
+  }
+  dist_object<NodeKmerTableLocation> location(world(), kmers->get_node_table_location());
+  node_tables.resize(local_team().rank_n());
+  for (int i = 0; i < local_team().rank_n(); i++) {
+    auto peer_location = (i == local_team().rank_me() ? *location : location.fetch(local_team()[i]).wait());
+    node_tables[i] = NodeKmerTable<MAX_K>(peer_location.mem.local(), peer_location.capacity);
+  }
+  // the location can't go out of scope while other ranks are still fetching it
+  barrier(local_team());
+  SLOG_CPU_HT("Using node shared kmer tables for ", local_team().rank_n(), " processes per node\n");
+  return true;
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::init(int num_elems, bool use_qf, bool use_sort_kcount, bool use_node_tables, int num_partitions,
+                                    const string &spill_dir) {
   state = new HashTableInserterState();
   state->using_ctg_kmers = false;
-  double free_mem = get_free_mem();
+  state->use_sort_kcount = use_sort_kcount;
+  // the table memory kept from earlier rounds is reused, so it counts as free
+  double free_mem = get_free_mem() + reduce_all(_table_mem_pool.get_bytes(), op_fast_add, local_team()).wait();
   SLOG_CPU_HT("There is ", get_size_str(free_mem), " free memory\n");
   // set aside a fraction of free mem for everything else, including the final hash table we copy across to
   double avail_mem = KCOUNT_CPU_HT_MEM_FRACTION * free_mem / local_team().rank_n();
@@ -434,10 +1183,26 @@ void HashTableInserter<MAX_K>::init(int num_elems, bool use_qf) {
   size_t elem_size = sizeof(Kmer<MAX_K>) + sizeof(KmerExtsCounts);
   size_t max_elems = avail_mem / elem_size;
   SLOG_CPU_HT("Request for ", num_elems, " elements and space available for ", max_elems, " elements of size ", elem_size, "\n");
-  // don't make too many extra elems because that takes longer to initialize
-  if (max_elems > 3 * num_elems) max_elems = 3 * num_elems;
-  SLOG_CPU_HT("Allocating ", max_elems, " elements\n");
-  state->kmers->reserve(max_elems);
+  // the distinct kmer estimate is already an upper bound, so the extra is only for kmers from contigs and the estimate error,
+  // and too many extra elems take longer to initialize
+  if (max_elems > 2 * num_elems) max_elems = 2 * num_elems;
+  if (num_partitions > 1) {
+    state->spills.init(num_partitions, spill_dir);
+    state->num_elems = num_elems;
+    state->max_elems = max_elems;
+  } else if (use_sort_kcount) {
+    // the sorted distinct kmers grow as needed, so only the occurrence buffers (and their sort scratch space) are preallocated
+    size_t max_buf_elems = avail_mem / 4 / (2 * sizeof(KmerAndExt<MAX_K>));
+    if (max_buf_elems > max_elems) max_buf_elems = max_elems;
+    if (max_buf_elems < 1000000) max_buf_elems = 1000000;
+    SLOG_CPU_HT("Using sort-based kmer counting\n");
+    state->sorted_kmers.reserve(max_buf_elems);
+  } else if (use_node_tables && init_node_tables(state->kmers, max_elems, state->node_tables)) {
+    state->received_node_table = state->node_tables[local_team().rank_me()];
+  } else {
+    SLOG_CPU_HT("Allocating ", max_elems, " elements\n");
+    state->kmers->reserve(max_elems);
+  }
   double used_mem = free_mem - get_free_mem();
   SLOG_CPU_HT("Memory available: ", get_size_str(get_free_mem()), ", used ", get_size_str(used_mem), "\n");
 }
@@ -448,22 +1213,97 @@ void HashTableInserter<MAX_K>::init_ctg_kmers(int max_elems) {
 }
 
 template <int MAX_K>
-void HashTableInserter<MAX_K>::insert_supermer(const std::string &supermer_seq, kmer_count_t supermer_count) {
-  Supermer supermer = {.seq = supermer_seq, .count = supermer_count};
-  for (int i = 0; i < supermer.seq.length(); i++) {
-    char base = toupper(supermer.seq[i]);
-    if (base != 'A' && base != 'C' && base != 'G' && base != 'T' && base != 'N')
-      DIE("bad char '", supermer.seq[i], "' in supermer seq int val ", (int)supermer.seq[i], " length ", supermer.seq.length(),
-          " supermer ", supermer.seq);
+void HashTableInserter<MAX_K>::insert_supermer(const SupermerChunk<MAX_K> &supermer) {
+  get_kmers_and_exts(supermer, state->kmers_buf, state->kmers_and_exts);
+  if (state->use_sort_kcount) {
+    if (!state->using_ctg_kmers) {
+      for (auto &kmer_and_ext : state->kmers_and_exts) state->sorted_kmers.add(kmer_and_ext);
+    } else {
+      state->ctg_kmers_and_exts.insert(state->ctg_kmers_and_exts.end(), state->kmers_and_exts.begin(),
+                                       state->kmers_and_exts.end());
+    }
+  } else if (!state->using_ctg_kmers) {
+    // the other ranks on the node may be inserting into the same table
+    if (has_node_tables())
+      insert_kmers_into_node_table(state->kmers_and_exts, state->slots, state->received_node_table);
+    else
+      insert_kmers_from_read(state->kmers_and_exts, state->slots, state->kmers);
+  } else {
+    insert_kmers_from_ctg(state->kmers_and_exts, state->slots, state->kmers);
   }
-  if (!state->using_ctg_kmers)
-    insert_supermer_from_read(supermer, state->kmers);
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::insert_supermers(const SupermerChunk<MAX_K> *supermers, size_t num_supermers) {
+  if (state->use_sort_kcount) {
+    for (size_t i = 0; i < num_supermers; i++) insert_supermer(supermers[i]);
+    return;
+  }
+  // the kmers of the whole batch are decoded first, so that the prefetching runs ahead across the supermers
+  auto &batch_kmers_and_exts = state->batch_kmers_and_exts;
+  batch_kmers_and_exts.clear();
+  for (size_t i = 0; i < num_supermers; i++) {
+    get_kmers_and_exts(supermers[i], state->kmers_buf, state->kmers_and_exts);
+    batch_kmers_and_exts.insert(batch_kmers_and_exts.end(), state->kmers_and_exts.begin(), state->kmers_and_exts.end());
+  }
+  if (state->using_ctg_kmers)
+    insert_kmers_from_ctg(batch_kmers_and_exts, state->slots, state->kmers);
+  else if (has_node_tables())
+    insert_kmers_into_node_table(batch_kmers_and_exts, state->slots, state->received_node_table);
   else
-    insert_supermer_from_ctg(supermer, state->kmers);
+    insert_kmers_from_read(batch_kmers_and_exts, state->slots, state->kmers);
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::insert_supermer_into_node_table(const SupermerChunk<MAX_K> &supermer, intrank_t target_rank) {
+  get_kmers_and_exts(supermer, state->direct_kmers_buf, state->direct_kmers_and_exts);
+  insert_kmers_into_node_table(state->direct_kmers_and_exts, state->direct_slots,
+                               state->node_tables[local_team().from_world(target_rank)]);
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::spill_supermer(const SupermerChunk<MAX_K> &supermer, int partition) {
+  state->spills.add(supermer, partition, state->using_ctg_kmers);
 }
 
 template <int MAX_K>
 void HashTableInserter<MAX_K>::flush_inserts() {
+  if (state->spills.get_num_partitions()) {
+    state->spills.flush();
+    auto tot_bytes_spilled = reduce_one(state->spills.get_bytes_spilled(), op_fast_add, 0).wait();
+    auto max_bytes_spilled = reduce_one(state->spills.get_bytes_spilled(), op_fast_max, 0).wait();
+    SLOG_CPU_HT("Spilled ", get_size_str(tot_bytes_spilled), " of supermers to ", state->spills.get_num_partitions(),
+                " kmer partitions per rank (max ", get_size_str(max_bytes_spilled), " per rank)\n");
+    return;
+  }
+  if (state->use_sort_kcount) {
+    state->sorted_kmers.sort_and_reduce();
+    state->sorted_kmers.merge_ctg_kmers(state->ctg_kmers_and_exts);
+    vector<KmerAndExt<MAX_K>>().swap(state->ctg_kmers_and_exts);
+    auto tot_num_kmers = reduce_one(state->sorted_kmers.size(), op_fast_add, 0).wait();
+    auto tot_num_occurrences = reduce_one(state->sorted_kmers.get_num_occurrences(), op_fast_add, 0).wait();
+    auto max_num_sorts = reduce_one(state->sorted_kmers.get_num_sorts(), op_fast_max, 0).wait();
+    SLOG_CPU_HT("Sorted ", tot_num_occurrences, " kmer occurrences into ", tot_num_kmers, " distinct kmers with at most ",
+                max_num_sorts, " sort passes per rank\n");
+    barrier();
+    auto avg_kmers_processed = tot_num_kmers / rank_n();
+    auto max_kmers_processed = reduce_one(state->sorted_kmers.size(), op_fast_max, 0).wait();
+    SLOG_CPU_HT("Avg kmers per rank ", avg_kmers_processed, " (balance ", (double)avg_kmers_processed / max_kmers_processed,
+                ")\n");
+    return;
+  }
+  if (has_node_tables()) {
+    // all the ranks on the node have finished inserting by now, and their stats are attributed to the inserting ranks
+    state->kmers->recount_elems();
+    auto add_insert_stats = [&kmers = state->kmers](NodeKmerTable<MAX_K> &node_table) {
+      kmers->add_insert_stats(node_table.sum_probe_lens, node_table.max_probe_len, node_table.num_dropped);
+      node_table.sum_probe_lens = 0;
+      node_table.max_probe_len = 0;
+      node_table.num_dropped = 0;
+    };
+    for (auto &node_table : state->node_tables) add_insert_stats(node_table);
+    add_insert_stats(state->received_node_table);
+  }
   int64_t tot_num_kmers = reduce_one(state->kmers->size(), op_fast_add, 0).wait();
   SLOG_CPU_HT("Number of elements in hash table: ", tot_num_kmers, "\n");
   auto avg_load_factor = reduce_one(state->kmers->load_factor(), op_fast_add, 0).wait() / upcxx::rank_n();
@@ -473,6 +1313,7 @@ void HashTableInserter<MAX_K>::flush_inserts() {
   auto max_probe_len = (double)reduce_one(state->kmers->get_max_probe_len(), op_fast_max, 0).wait();
   SLOG_CPU_HT("kmer DHT probe lengths: ", avg_probe_len, " avg, ", max_probe_len, " max\n");
   auto tot_num_dropped = reduce_one(state->kmers->get_num_dropped(), op_fast_add, 0).wait();
+  state->num_dropped += state->kmers->get_num_dropped();
   state->kmers->clear_num_dropped();
   auto tot_kmers = tot_num_kmers + tot_num_dropped;
   if (tot_num_dropped) SLOG_CPU_HT("Number dropped ", perc_str(tot_num_dropped, tot_kmers), "\n");
@@ -487,46 +1328,134 @@ void HashTableInserter<MAX_K>::flush_inserts() {
   SLOG_CPU_HT("Avg kmers per rank ", avg_kmers_processed, " (balance ", (double)avg_kmers_processed / max_kmers_processed, ")\n");
 }
 
-template <int MAX_K>
-void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers) {
-  int64_t num_good_kmers = state->kmers->size();
-  state->kmers->begin_iterate();
+// returns the number of kmers purged
+template <int MAX_K, class KmerExtsTable>
+static int64_t add_to_local_hashtable(KmerExtsTable &kmers, dist_object<KmerMap<MAX_K>> &local_kmers, KmerHistogram &histogram,
+                                      const std::function<void(const KmerTableRecord<MAX_K> &)> &dump_record) {
+  int64_t num_good_kmers = kmers.size();
+  kmers.begin_iterate();
   while (true) {
-    auto [kmer, kmer_ext_counts] = state->kmers->get_next();
+    auto [kmer, kmer_ext_counts] = kmers.get_next();
     if (!kmer) break;
-    if ((kmer_ext_counts->count < 2) || (kmer_ext_counts->left_exts.is_zero() && kmer_ext_counts->right_exts.is_zero()))
+    histogram.add(kmer_ext_counts->get_count());
+    if ((kmer_ext_counts->get_count() < 2) || (kmer_ext_counts->left_exts.is_zero() && kmer_ext_counts->right_exts.is_zero()))
       num_good_kmers--;
   }
-  local_kmers->reserve(num_good_kmers);
+  local_kmers->reserve(local_kmers->size() + num_good_kmers);
   int64_t num_purged = 0;
-  state->kmers->begin_iterate();
+  kmers.begin_iterate();
   while (true) {
-    auto [kmer, kmer_ext_counts] = state->kmers->get_next();
+    auto [kmer, kmer_ext_counts] = kmers.get_next();
     if (!kmer) break;
-    if (kmer_ext_counts->count < 2) {
+    if (kmer_ext_counts->get_count() < 2) {
       num_purged++;
       continue;
     }
-    KmerCounts kmer_counts = {.uutig_frag = nullptr,
-                              .count = kmer_ext_counts->count,
-                              .left = kmer_ext_counts->get_left_ext(),
-                              .right = kmer_ext_counts->get_right_ext()};
-    if (kmer_counts.left == 'X' && kmer_counts.right == 'X') {
+    if (dump_record) {
+      // zeroed so that the padding is written deterministically
+      KmerTableRecord<MAX_K> record;
+      memset((void *)&record, 0, sizeof(record));
+      record.kmer = *kmer;
+      record.count = kmer_ext_counts->get_count();
+      for (int i = 0; i < 4; i++) {
+        record.left_ext_counts[i] = kmer_ext_counts->left_exts.get(i);
+        record.right_ext_counts[i] = kmer_ext_counts->right_exts.get(i);
+      }
+      dump_record(record);
+    }
+    char left_ext = kmer_ext_counts->get_left_ext();
+    char right_ext = kmer_ext_counts->get_right_ext();
+    if (left_ext == 'X' && right_ext == 'X') {
       num_purged++;
       continue;
     }
     const auto it = local_kmers->find(*kmer);
     if (it != local_kmers->end())
       WARN("Found a duplicate kmer ", kmer->to_string(), " - shouldn't happen: existing count ", it->second.count, " new count ",
-           kmer_counts.count);
+           kmer_ext_counts->get_count());
+    KmerCounts kmer_counts = {.frag_idx = 0, .count = kmer_ext_counts->get_count(), .exts = KmerCounts::pack_exts(left_ext, right_ext)};
     local_kmers->insert({*kmer, kmer_counts});
   }
+  return num_purged;
+}
+
+static void log_num_purged(int64_t num_purged, int64_t num_kmers) {
   barrier();
   auto tot_num_purged = reduce_one(num_purged, op_fast_add, 0).wait();
-  auto tot_num_kmers = reduce_one(state->kmers->size(), op_fast_add, 0).wait();
+  auto tot_num_kmers = reduce_one(num_kmers, op_fast_add, 0).wait();
   SLOG_CPU_HT("Purged ", tot_num_purged, " kmers ( ", perc_str(tot_num_purged, tot_num_kmers), ")\n");
 }
 
+template <int MAX_K, class KmerExtsTable>
+static void copy_into_local_hashtable(KmerExtsTable &kmers, dist_object<KmerMap<MAX_K>> &local_kmers, KmerHistogram &histogram,
+                                      const std::function<void(const KmerTableRecord<MAX_K> &)> &dump_record) {
+  auto num_purged = add_to_local_hashtable<MAX_K>(kmers, local_kmers, histogram, dump_record);
+  log_num_purged(num_purged, kmers.size());
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers, KmerHistogram &histogram,
+                                                           const std::function<void(const KmerTableRecord<MAX_K> &)> &dump_record) {
+  histogram.add_num_dropped(state->num_dropped);
+  if (state->use_sort_kcount) {
+    copy_into_local_hashtable<MAX_K>(state->sorted_kmers, local_kmers, histogram, dump_record);
+    return;
+  }
+  auto num_partitions = state->spills.get_num_partitions();
+  if (!num_partitions) {
+    copy_into_local_hashtable<MAX_K>(*state->kmers, local_kmers, histogram, dump_record);
+    return;
+  }
+  // each partition gets its share of the distinct kmers estimated for the whole table, from its share of the read kmers, plus
+  // all of its ctg kmers
+  int64_t num_read_kmers = 0;
+  for (int i = 0; i < num_partitions; i++) num_read_kmers += state->spills.get_num_kmers(i, false);
+  vector<int64_t> partition_max_elems(num_partitions);
+  for (int i = 0; i < num_partitions; i++) {
+    auto &max_elems = partition_max_elems[i];
+    if (num_read_kmers) max_elems = 2.0 * state->num_elems * state->spills.get_num_kmers(i, false) / num_read_kmers;
+    max_elems = min(max(max_elems + state->spills.get_num_kmers(i, true), (int64_t)1000), state->max_elems);
+  }
+  // the table buffers are allocated for the largest partition and reused for all of them
+  state->kmers->reserve(*max_element(partition_max_elems.begin(), partition_max_elems.end()));
+  int64_t num_kmers = 0, num_purged = 0;
+  double max_load_factor = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    state->kmers->reserve(partition_max_elems[i]);
+    // the partitions are sized from the kmers counted when spilling, so those counts must match the kmers inserted
+    int64_t num_read_kmers_inserted = 0, num_ctg_kmers_inserted = 0;
+    state->spills.read(i, false, [&state = this->state, &num_read_kmers_inserted](const SupermerChunk<MAX_K> &supermer) {
+      get_kmers_and_exts(supermer, state->kmers_buf, state->kmers_and_exts);
+      insert_kmers_from_read(state->kmers_and_exts, state->slots, state->kmers);
+      num_read_kmers_inserted += state->kmers_and_exts.size();
+    });
+    state->spills.read(i, true, [&state = this->state, &num_ctg_kmers_inserted](const SupermerChunk<MAX_K> &supermer) {
+      get_kmers_and_exts(supermer, state->kmers_buf, state->kmers_and_exts);
+      insert_kmers_from_ctg(state->kmers_and_exts, state->slots, state->kmers);
+      num_ctg_kmers_inserted += state->kmers_and_exts.size();
+    });
+    if (num_read_kmers_inserted != state->spills.get_num_kmers(i, false) ||
+        num_ctg_kmers_inserted != state->spills.get_num_kmers(i, true))
+      WARN("Kmer partition ", i, " has ", num_read_kmers_inserted, " read and ", num_ctg_kmers_inserted,
+           " ctg kmers, but was sized for ", state->spills.get_num_kmers(i, false), " and ", state->spills.get_num_kmers(i, true));
+    num_kmers += state->kmers->size();
+    max_load_factor = max(max_load_factor, state->kmers->load_factor());
+    num_purged += add_to_local_hashtable<MAX_K>(*state->kmers, local_kmers, histogram, dump_record);
+  }
+  auto tot_num_kmers = reduce_one(num_kmers, op_fast_add, 0).wait();
+  auto all_max_load_factor = reduce_one(max_load_factor, op_fast_max, 0).wait();
+  SLOG_CPU_HT("Counted ", tot_num_kmers, " kmers in ", num_partitions, " partitions per rank, with a max load factor of ",
+              all_max_load_factor, "\n");
+  histogram.add_num_dropped(state->kmers->get_num_dropped());
+  auto tot_num_dropped = reduce_one(state->kmers->get_num_dropped(), op_fast_add, 0).wait();
+  auto tot_num_overrides = reduce_one(state->kmers->get_num_singleton_overrides(), op_fast_add, 0).wait();
+  if (100.0 * tot_num_dropped / (tot_num_kmers + tot_num_dropped) > 0.1)
+    SWARN("Lack of memory caused ", perc_str(tot_num_dropped, tot_num_kmers + tot_num_dropped),
+          " kmers to be dropped (singleton overrides ", perc_str(tot_num_overrides, tot_num_kmers + tot_num_dropped),
+          "); use more kmer partitions\n");
+  log_num_purged(num_purged, num_kmers);
+}
+
 //template <int MAX_K>
 //void HashTableInserter<MAX_K>::get_elapsed_time(double &insert_time, double &kernel_time) {}
 
@@ -65,6 +65,7 @@ struct SeqBlockInserter<MAX_K>::SeqBlockInserterState {
   int64_t num_kmers = 0;
   int64_t bytes_kmers_sent = 0;
   int64_t bytes_supermers_sent = 0;
+  int64_t bytes_supermers_sent_off_node = 0;
   string seq_block;
   vector<kmer_count_t> depth_block;
 
@@ -76,10 +77,11 @@ struct SeqBlockInserter<MAX_K>::SeqBlockInserterState {
 };
 
 template <int MAX_K>
-SeqBlockInserter<MAX_K>::SeqBlockInserter(int qual_offset, int minimizer_len) {
+SeqBlockInserter<MAX_K>::SeqBlockInserter(int qual_offset, int minimizer_len, int num_minimizer_buckets, int num_threads) {
   double init_time;
   state = new SeqBlockInserterState();
-  state->pnp_gpu_driver = new ParseAndPackGPUDriver(rank_me(), rank_n(), qual_offset, Kmer<MAX_K>::get_k(),
+  // the GPU computes the minimizer bucket of each kmer, which is mapped to the target rank when the supermers are sent
+  state->pnp_gpu_driver = new ParseAndPackGPUDriver(rank_me(), num_minimizer_buckets, qual_offset, Kmer<MAX_K>::get_k(),
                                                     Kmer<MAX_K>::get_N_LONGS(), minimizer_len, init_time);
   SLOG_GPU("Initialized PnP GPU driver in ", fixed, setprecision(3), init_time, " s\n");
 }
@@ -116,19 +118,26 @@ static void process_block(SeqBlockInserter<MAX_K> *seq_block_inserter, dist_obje
   fut_pnp.wait();
   int num_targets = (int)state->pnp_gpu_driver->supermers.size();
   for (int i = 0; i < num_targets; i++) {
-    auto target = state->pnp_gpu_driver->supermers[i].target;
+    auto target = kmer_dht->get_bucket_target_rank(state->pnp_gpu_driver->supermers[i].target);
     auto offset = state->pnp_gpu_driver->supermers[i].offset;
     auto len = state->pnp_gpu_driver->supermers[i].len;
     Supermer supermer;
-    int packed_len = len / 2;
-    if (offset % 2 || len % 2) packed_len++;
-    supermer.seq = state->pnp_gpu_driver->packed_seqs.substr(offset / 2, packed_len);
-    if (offset % 2) supermer.seq[0] &= 15;
-    if ((offset + len) % 2) supermer.seq[supermer.seq.length() - 1] &= 240;
     supermer.count = (from_ctgs ? state->depth_block[offset + 1] : (kmer_count_t)1);
-    state->bytes_supermers_sent += supermer.get_bytes();
-    kmer_dht->add_supermer(supermer, target);
-    state->num_kmers += (2 * supermer.seq.length() - Kmer<MAX_K>::get_k());
+    // long supermers are split with an overlap of k + 1 bases, so that every kmer is sent once with both its extensions
+    for (int chunk_offset = offset;; chunk_offset += SupermerChunk<MAX_K>::MAX_BASES - Kmer<MAX_K>::get_k() - 1) {
+      int chunk_len = min(offset + len - chunk_offset, SupermerChunk<MAX_K>::MAX_BASES);
+      int packed_len = chunk_len / 2;
+      if (chunk_offset % 2 || chunk_len % 2) packed_len++;
+      supermer.seq = state->pnp_gpu_driver->packed_seqs.substr(chunk_offset / 2, packed_len);
+      if (chunk_offset % 2) supermer.seq[0] &= 15;
+      if ((chunk_offset + chunk_len) % 2) supermer.seq[supermer.seq.length() - 1] &= 240;
+      auto record_bytes = SupermerChunk<MAX_K>::get_record_bytes(supermer.seq.length());
+      state->bytes_supermers_sent += record_bytes;
+      if (!local_team_contains(target)) state->bytes_supermers_sent_off_node += record_bytes;
+      kmer_dht->add_supermer(supermer, target);
+      state->num_kmers += (2 * supermer.seq.length() - Kmer<MAX_K>::get_k());
+      if (chunk_offset + chunk_len == offset + len) break;
+    }
     progress();
   }
 }
@@ -148,6 +157,17 @@ void SeqBlockInserter<MAX_K>::process_seq(string &seq, kmer_count_t depth, dist_
   if (depth) state->depth_block.insert(state->depth_block.end(), seq.length() + 1, depth);
 }
 
+template <int MAX_K>
+bool SeqBlockInserter<MAX_K>::supports_packed_seqs() {
+  return false;
+}
+
+template <int MAX_K>
+void SeqBlockInserter<MAX_K>::process_packed_seq(const PackedSupermerView &packed_seq, kmer_count_t depth,
+                                                 dist_object<KmerDHT<MAX_K>> &kmer_dht) {
+  DIE("Packed seqs cannot be processed on the GPU");
+}
+
 template <int MAX_K>
 void SeqBlockInserter<MAX_K>::done_processing(dist_object<KmerDHT<MAX_K>> &kmer_dht) {
   if (kmer_dht->using_ctg_kmers) {
@@ -169,6 +189,8 @@ void SeqBlockInserter<MAX_K>::done_processing(dist_object<KmerDHT<MAX_K>> &kmer_
   auto tot_kmers_bytes_sent = reduce_one(state->bytes_kmers_sent, op_fast_add, 0).wait();
   SLOG_VERBOSE("Total bytes sent in compressed supermers ", get_size_str(tot_supermers_bytes_sent), " (compression is ", fixed,
                setprecision(3), (double)tot_kmers_bytes_sent / tot_supermers_bytes_sent, " over kmers)\n");
+  auto tot_supermers_bytes_sent_off_node = reduce_one(state->bytes_supermers_sent_off_node, op_fast_add, 0).wait();
+  SLOG_VERBOSE("Supermer bytes sent to other nodes ", perc_str(tot_supermers_bytes_sent_off_node, tot_supermers_bytes_sent), "\n");
   auto all_num_kmers = reduce_one(state->num_kmers, op_fast_add, 0).wait();
   SLOG_VERBOSE("Processed a total of ", all_num_kmers, " kmers\n");
   barrier();
@@ -177,6 +199,8 @@ void SeqBlockInserter<MAX_K>::done_processing(dist_object<KmerDHT<MAX_K>> &kmer_
 template <int MAX_K>
 struct HashTableInserter<MAX_K>::HashTableInserterState {
   HashTableGPUDriver<MAX_K> ht_gpu_driver;
+  // the kmers dropped from the table in the passes flushed so far, which are missing from the histogram
+  int64_t num_dropped = 0;
 
   HashTableInserterState()
       : ht_gpu_driver({}) {}
@@ -191,8 +215,16 @@ HashTableInserter<MAX_K>::~HashTableInserter() {
 }
 
 template <int MAX_K>
-void HashTableInserter<MAX_K>::init(int max_elems, bool use_qf) {
+bool HashTableInserter<MAX_K>::supports_host_kmer_targets() {
+  return false;
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::init(int max_elems, bool use_qf, bool use_sort_kcount, bool use_node_tables, int num_partitions,
+                                    const string &spill_dir) {
   this->use_qf = use_qf;
+  if (use_sort_kcount) SWARN("Sort-based kmer counting is not available on the GPU, using the GPU hash table");
+  if (use_node_tables) SWARN("Node shared kmer tables are not available on the GPU, using a table per process");
   state = new HashTableInserterState();
   double init_time;
   // calculate total slots for hash table. Reserve space for parse and pack
@@ -233,9 +265,29 @@ void HashTableInserter<MAX_K>::init_ctg_kmers(int max_elems) {
 }
 
 template <int MAX_K>
-void HashTableInserter<MAX_K>::insert_supermer(const std::string &supermer_seq, kmer_count_t supermer_count) {
+void HashTableInserter<MAX_K>::insert_supermers(const SupermerChunk<MAX_K> *supermers, size_t num_supermers) {
+  for (size_t i = 0; i < num_supermers; i++) insert_supermer(supermers[i]);
+}
+
+template <int MAX_K>
+bool HashTableInserter<MAX_K>::has_node_tables() {
+  return false;
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::spill_supermer(const SupermerChunk<MAX_K> &supermer, int partition) {
+  DIE("Kmer partitions are not available on the GPU");
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::insert_supermer_into_node_table(const SupermerChunk<MAX_K> &supermer, intrank_t target_rank) {
+  DIE("Node shared kmer tables are not available on the GPU");
+}
+
+template <int MAX_K>
+void HashTableInserter<MAX_K>::insert_supermer(const SupermerChunk<MAX_K> &supermer) {
   assert(state != nullptr);
-  state->ht_gpu_driver.insert_supermer(supermer_seq, supermer_count);
+  state->ht_gpu_driver.insert_supermer(supermer.get_seq(), supermer.count);
 }
 
 template <int MAX_K>
@@ -251,6 +303,7 @@ void HashTableInserter<MAX_K>::flush_inserts() {
   // a bunch of stats about the hash table on the GPU
   auto insert_stats = state->ht_gpu_driver.get_stats();
   uint64_t num_dropped_elems = reduce_one((uint64_t)insert_stats.dropped, op_fast_add, 0).wait();
+  state->num_dropped += insert_stats.dropped;
   uint64_t num_attempted_inserts = reduce_one((uint64_t)insert_stats.attempted, op_fast_add, 0).wait();
   uint64_t num_inserts = reduce_one((uint64_t)insert_stats.new_inserts, op_fast_add, 0).wait();
   uint64_t capacity = state->ht_gpu_driver.get_capacity();
@@ -282,13 +335,17 @@ void HashTableInserter<MAX_K>::get_elapsed_time(double &insert_time, double &ker
 }
 
 template <int MAX_K>
-void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers) {
+void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers, KmerHistogram &histogram,
+                                                           const std::function<void(const KmerTableRecord<MAX_K> &)> &dump_record) {
+  // the extensions are chosen on the device, so there are no extension counts to dump
+  if (dump_record) DIE("The binary kmer tables cannot be dumped from the GPU");
   barrier();
   IntermittentTimer insert_timer("gpu insert to cpu timer");
   insert_timer.start();
   if (state->ht_gpu_driver.pass_type == CTG_KMERS_PASS) {
     int attempted_inserts = 0, dropped_inserts = 0, new_inserts = 0;
     state->ht_gpu_driver.done_ctg_kmer_inserts(attempted_inserts, dropped_inserts, new_inserts);
+    state->num_dropped += dropped_inserts;
     barrier();
     auto num_dropped_elems = reduce_one((uint64_t)dropped_inserts, op_fast_add, 0).wait();
     auto num_attempted_inserts = reduce_one((uint64_t)attempted_inserts, op_fast_add, 0).wait();
@@ -323,12 +380,16 @@ void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<M
 
   // add some space for the ctg kmers
   local_kmers->reserve(num_entries * 1.5);
+  // the singletons were already purged on the device
+  histogram.add(1, num_purged);
+  histogram.add_num_dropped(state->num_dropped + num_dropped);
   uint64_t invalid = 0;
   while (true) {
     auto [kmer_array, count_exts] = state->ht_gpu_driver.get_next_entry();
     if (!kmer_array) break;
     // empty slot
     if (!count_exts->count) continue;
+    histogram.add(min(count_exts->count, static_cast<count_t>(UINT16_MAX)));
     if ((char)count_exts->left == 'X' && (char)count_exts->right == 'X') {
       // these are eliminated during purging in CPU version
       invalid++;
@@ -339,10 +400,9 @@ void HashTableInserter<MAX_K>::insert_into_local_hashtable(dist_object<KmerMap<M
       invalid++;
       continue;
     }
-    KmerCounts kmer_counts = {.uutig_frag = nullptr,
+    KmerCounts kmer_counts = {.frag_idx = 0,
                               .count = static_cast<kmer_count_t>(min(count_exts->count, static_cast<count_t>(UINT16_MAX))),
-                              .left = (char)count_exts->left,
-                              .right = (char)count_exts->right};
+                              .exts = KmerCounts::pack_exts((char)count_exts->left, (char)count_exts->right)};
     Kmer<MAX_K> kmer(reinterpret_cast<const uint64_t *>(kmer_array->longs));
     const auto it = local_kmers->find(kmer);
     if (it != local_kmers->end())
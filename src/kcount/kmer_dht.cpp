@@ -40,21 +40,30 @@
  form.
 */
 
+#include <fcntl.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <numeric>
+#include <queue>
 
 #include "upcxx_utils/log.hpp"
 #include "upcxx_utils/mem_profile.hpp"
+#include "upcxx_utils/split_rank.hpp"
 
 
 #include "zstr.hpp"
 
+#include "hash_funcs.h"
 #include "kmer_dht.hpp"
+#include "packed_reads.hpp"
 
 using namespace std;
 using namespace upcxx;
@@ -67,92 +76,507 @@ using namespace upcxx_utils;
 
 static int num_inserts = 0;
 
-void Supermer::pack(const string &unpacked_seq) {
-  // each position in the sequence is an upper or lower case nucleotide, not including Ns
-  seq = string(unpacked_seq.length() / 2 + unpacked_seq.length() % 2, 0);
-  for (int i = 0; i < unpacked_seq.length(); i++) {
-    char packed_val = 0;
-    switch (unpacked_seq[i]) {
-      case 'a': packed_val = 1; break;
-      case 'c': packed_val = 2; break;
-      case 'g': packed_val = 3; break;
-      case 't': packed_val = 4; break;
-      case 'A': packed_val = 5; break;
-      case 'C': packed_val = 6; break;
-      case 'G': packed_val = 7; break;
-      case 'T': packed_val = 8; break;
-      case 'N': packed_val = 9; break;
+// writes the header and zeroes the space for the bases and the quality bitmask, returning the offset of the bases
+static int pack_supermer_header(string &seq, int len, bool has_bad_quals) {
+  seq.clear();
+  for (uint64_t header = ((uint64_t)len << 1) | has_bad_quals;; header >>= 7) {
+    if (header < 128) {
+      seq += (char)header;
+      break;
+    }
+    seq += (char)((header & 127) | 128);
+  }
+  int header_bytes = seq.length();
+  seq.resize(header_bytes + (len + 3) / 4 + (has_bad_quals ? (len + 7) / 8 : 0), 0);
+  return header_bytes;
+}
+
+void Supermer::pack(string_view unpacked_seq) {
+  int len = unpacked_seq.length();
+  bool has_bad_quals = false;
+  for (auto base : unpacked_seq) {
+    if (!isupper(base) || base == 'N') {
+      has_bad_quals = true;
+      break;
+    }
+  }
+  int header_bytes = pack_supermer_header(seq, len, has_bad_quals);
+  auto bases = (uint8_t *)seq.data() + header_bytes;
+  auto quals = bases + (len + 3) / 4;
+  for (int i = 0; i < len; i++) {
+    uint8_t packed_val = 0;
+    // Ns are packed as G, like in the kmer encoding, and can never be used as extensions
+    switch (toupper(unpacked_seq[i])) {
+      case 'A': packed_val = 0; break;
+      case 'C': packed_val = 1; break;
+      case 'G': packed_val = 2; break;
+      case 'T': packed_val = 3; break;
+      case 'N': packed_val = 2; break;
       default: DIE("Invalid value encountered when packing '", unpacked_seq[i], "' ", (int)unpacked_seq[i]);
     };
-    seq[i / 2] |= (!(i % 2) ? (packed_val << 4) : packed_val);
-    if (seq[i / 2] == '_') DIE("packed byte is same as sentinel _");
+    bool good_qual = isupper(unpacked_seq[i]) && unpacked_seq[i] != 'N';
+    bases[i / 4] |= packed_val << (2 * (3 - i % 4));
+    if (has_bad_quals && good_qual) quals[i / 8] |= 1 << (i % 8);
+  }
+}
+
+void Supermer::pack(const PackedSupermerView &packed_seq, int start, int len) {
+  bool has_bad_quals = false;
+  if (packed_seq.quals) {
+    for (int i = start; i < start + len; i++) {
+      if (!packed_seq.is_good_qual(i)) {
+        has_bad_quals = true;
+        break;
+      }
+    }
+  }
+  int header_bytes = pack_supermer_header(seq, len, has_bad_quals);
+  auto bases = (uint8_t *)seq.data() + header_bytes;
+  auto quals = bases + (len + 3) / 4;
+  for (int i = 0; i < len; i++) {
+    bases[i / 4] |= packed_seq.get_code(start + i) << (2 * (3 - i % 4));
+    if (has_bad_quals && packed_seq.is_good_qual(start + i)) quals[i / 8] |= 1 << (i % 8);
+  }
+}
+
+PackedSupermerView PackedSupermerView::unpack(const uint8_t *buf, int num_bytes) {
+  uint64_t header = 0;
+  int pos = 0;
+  for (int shift = 0;; shift += 7) {
+    if (pos >= num_bytes) DIE("Truncated header in packed supermer of ", num_bytes, " bytes");
+    header |= (uint64_t)(buf[pos] & 127) << shift;
+    if (!(buf[pos++] & 128)) break;
+  }
+  int len = header >> 1;
+  bool has_bad_quals = header & 1;
+  int num_base_bytes = (len + 3) / 4;
+  if (num_bytes != pos + num_base_bytes + (has_bad_quals ? (len + 7) / 8 : 0))
+    DIE("Packed supermer of length ", len, " has the wrong number of bytes, ", num_bytes);
+  return {.len = len, .bases = buf + pos, .quals = has_bad_quals ? buf + pos + num_base_bytes : nullptr};
+}
+
+// the bytes sent for a supermer of this many bases with the CPU packing, assuming all the bases are good quality
+template <int MAX_K>
+static int get_packed_record_bytes(int len) {
+  int header_bytes = 1;
+  for (uint64_t header = (uint64_t)len << 1; header >= 128; header >>= 7) header_bytes++;
+  return SupermerChunk<MAX_K>::get_record_bytes(header_bytes + (len + 3) / 4);
+}
+
+HyperLogLog::HyperLogLog()
+    : registers(1 << INDEX_BITS, 0) {}
+
+void HyperLogLog::merge_all() { reduce_all(registers.data(), registers.data(), registers.size(), op_fast_max).wait(); }
+
+double HyperLogLog::estimate() const {
+  double num_registers = registers.size();
+  double sum = 0;
+  int num_zeros = 0;
+  for (auto reg : registers) {
+    sum += 1.0 / (1ULL << reg);
+    if (!reg) num_zeros++;
   }
+  double alpha = 0.7213 / (1 + 1.079 / num_registers);
+  double estimate = alpha * num_registers * num_registers / sum;
+  // linear counting is more accurate for small cardinalities
+  if (estimate < 2.5 * num_registers && num_zeros) estimate = num_registers * log(num_registers / num_zeros);
+  return estimate;
+}
+
+KmerHistogram::KmerHistogram()
+    : num_kmers(MAX_COUNT + 1, 0) {}
+
+void KmerHistogram::merge_all() {
+  reduce_all(num_kmers.data(), num_kmers.data(), num_kmers.size(), op_fast_add).wait();
+  num_dropped = reduce_all(num_dropped, op_fast_add).wait();
 }
 
-void Supermer::unpack() {
-  static const char to_base[] = {0, 'a', 'c', 'g', 't', 'A', 'C', 'G', 'T', 'N'};
-  string unpacked_seq;
-  for (int i = 0; i < seq.length(); i++) {
-    unpacked_seq += to_base[(seq[i] & 240) >> 4];
-    int right_ext = seq[i] & 15;
-    if (right_ext) unpacked_seq += to_base[right_ext];
+int64_t KmerHistogram::get_num_distinct() const { return std::accumulate(num_kmers.begin(), num_kmers.end(), (int64_t)0); }
+
+void KmerHistogram::write(const string &fname) const {
+  ofstream f(fname);
+  if (!f) DIE("Could not open ", fname, " for writing: ", strerror(errno));
+  for (int count = 0; count <= MAX_COUNT; count++) {
+    if (num_kmers[count]) f << count << "\t" << num_kmers[count] << "\n";
+  }
+  f.close();
+}
+
+void KmerTableSizes::add(int kmer_len, const KmerHistogram &histogram) {
+  kmer_lens.push_back(kmer_len);
+  num_distinct.push_back(histogram.get_num_distinct());
+  num_singletons.push_back(histogram.get_num_singletons());
+  num_dropped.push_back(histogram.get_num_dropped());
+}
+
+bool KmerTableSizes::predict(int kmer_len, int64_t &predicted_num_distinct, double &predicted_singleton_fraction) const {
+  if (kmer_lens.empty() || !num_distinct.back()) return false;
+  int last = kmer_lens.size() - 1;
+  double num_solid = num_distinct[last] - num_singletons[last];
+  if (last > 0 && kmer_lens[last] > kmer_lens[last - 1] && num_distinct[last - 1] > num_singletons[last - 1]) {
+    double solid_per_k = pow(num_solid / (num_distinct[last - 1] - num_singletons[last - 1]),
+                             1.0 / (kmer_lens[last] - kmer_lens[last - 1]));
+    num_solid *= min(2.0, max(0.5, pow(solid_per_k, kmer_len - kmer_lens[last])));
+  }
+  double singletons = (double)num_singletons[last] * kmer_len / kmer_lens[last];
+  predicted_num_distinct = num_solid + singletons;
+  predicted_singleton_fraction = singletons / (num_solid + singletons);
+  return true;
+}
+
+void KmerTableSizes::clear() {
+  kmer_lens.clear();
+  num_distinct.clear();
+  num_singletons.clear();
+  num_dropped.clear();
+}
+
+CountMinSketch::CountMinSketch(int64_t num_bytes)
+    : row_width(max((int64_t)1, num_bytes / (int64_t)(NUM_ROWS * sizeof(uint32_t))))
+    , counts(NUM_ROWS * row_width, 0) {}
+
+// sums are saturated on each rank, but the merged sums could still wrap for extremely abundant kmers in a very small sketch
+void CountMinSketch::merge_all() { reduce_all(counts.data(), counts.data(), counts.size(), op_fast_add).wait(); }
+
+void *TableMemPool::acquire(BufferId id, size_t bytes) {
+  auto &buffer = buffers[id];
+  if (buffer.in_use) DIE("Table memory buffer ", (int)id, " is already in use");
+  if (buffer.bytes < bytes) {
+    // free first so that the old and new buffers are never both held
+    buffer.data.reset();
+    buffer.data.reset(new uint8_t[bytes]);
+    buffer.bytes = bytes;
+  }
+  buffer.in_use = true;
+  return buffer.data.get();
+}
+
+void TableMemPool::release(BufferId id) { buffers[id].in_use = false; }
+
+void TableMemPool::clear() {
+  for (auto &buffer : buffers) {
+    if (buffer.in_use) DIE("Cannot clear the table memory while it is in use");
+    buffer.data.reset();
+    buffer.bytes = 0;
   }
-  seq = unpacked_seq;
 }
 
-int Supermer::get_bytes() { return seq.length() + sizeof(kmer_count_t); }
+size_t TableMemPool::get_bytes() const {
+  size_t bytes = 0;
+  for (auto &buffer : buffers) bytes += buffer.bytes;
+  return bytes;
+}
+
+// the minimizer hashes are split into this many buckets per rank when balancing
+static const int MINIMIZER_BUCKETS_PER_RANK = 16;
+
+// the node is chosen from a minimizer of this length when sending kmers to nodes first
+static const int NODE_MINIMIZER_LEN = 11;
+
+// A rank can own no sampled minimizer buckets and still receive kmers, so the estimate for each rank is never less than this
+// many kmers, or this fraction of the average per rank.
+static const int64_t MIN_EST_KMERS_PER_RANK = 10000;
+static const double MIN_EST_KMERS_AVG_FRACTION = 0.25;
+
+// maps a 32-bit hash uniformly onto [0, n) with a multiply instead of a modulo
+static inline uint32_t fastrange32(uint32_t hash, uint32_t n) { return ((uint64_t)hash * n) >> 32; }
 
 template <int MAX_K>
-KmerDHT<MAX_K>::KmerDHT(uint64_t my_num_kmers, int max_kmer_store_bytes, int max_rpcs_in_flight, bool useHHSS, bool use_qf)
+KmerDHT<MAX_K>::KmerDHT(vector<PackedReads *> &packed_reads_list, int max_kmer_store_bytes, int max_rpcs_in_flight, bool useHHSS,
+                        bool use_qf, bool use_sort_kcount, int supermer_cache_size, bool balance_kmer_targets,
+                        bool node_first_targets, bool load_kmers, bool use_node_tables, int num_kmer_partitions,
+                        const string &kmer_spill_dir, bool use_insert_thread)
     : local_kmers({})
+    , static_index({})
     , ht_inserter({})
     , kmer_store()
+    , supermer_cache(supermer_cache_size)
     , max_kmer_store_bytes(max_kmer_store_bytes)
-    , my_num_kmers(my_num_kmers)
     , max_rpcs_in_flight(max_rpcs_in_flight) {
+  static_assert(std::is_trivial<SupermerBlock<MAX_K>>::value, "supermer blocks must be trivial for the three tier store");
+  // value initialized, so all the blocks start empty
+  send_blocks.resize(rank_n());
   // minimizer len depends on k
   minimizer_len = Kmer<MAX_K>::get_k() * 2 / 3 + 1;
   if (minimizer_len < 15) minimizer_len = 15;
   if (minimizer_len > 27) minimizer_len = 27;
-  SLOG_VERBOSE("Using a minimizer length of ", minimizer_len, "\n");
-  
-  auto node0_cores = upcxx::local_team().rank_n();
+  if (_minimizer_scheme != MinimizerScheme::GREATEST && !HashTableInserter<MAX_K>::supports_host_kmer_targets()) {
+    SWARN("The ", minimizer_scheme_to_string(_minimizer_scheme), " minimizer scheme is not available on the GPU, using ",
+          minimizer_scheme_to_string(MinimizerScheme::GREATEST));
+    _minimizer_scheme = MinimizerScheme::GREATEST;
+  }
+  SLOG_VERBOSE("Using a minimizer length of ", minimizer_len, " with the ", minimizer_scheme_to_string(_minimizer_scheme),
+               " scheme\n");
+  if (node_first_targets && balance_kmer_targets) {
+    SWARN("Node first kmer targets cannot be combined with balanced kmer targets, using balanced targets");
+  } else if (node_first_targets && !HashTableInserter<MAX_K>::supports_host_kmer_targets()) {
+    SWARN("Node first kmer targets are not available on the GPU, using the default targets");
+  } else if (node_first_targets) {
+    this->node_first_targets = true;
+    num_target_nodes = split_rank::num_nodes();
+    num_target_threads = split_rank::num_threads();
+    SLOG_VERBOSE("Sending kmers to nodes using a minimizer length of ", NODE_MINIMIZER_LEN, ", then to ranks within the node\n");
+  }
+  if (num_kmer_partitions > 1 && !HashTableInserter<MAX_K>::supports_host_kmer_targets()) {
+    SWARN("Kmer partitions are not available on the GPU, counting all the kmers at once");
+  } else if (num_kmer_partitions > 1 && use_sort_kcount) {
+    SWARN("Kmer partitions cannot be combined with sort-based kmer counting, counting all the kmers at once");
+  } else if (num_kmer_partitions > 1) {
+    this->num_kmer_partitions = num_kmer_partitions;
+    if (use_node_tables) {
+      SWARN("Node shared kmer tables cannot be combined with kmer partitions, using a table per process");
+      use_node_tables = false;
+    }
+    SLOG_VERBOSE("Counting kmers in ", num_kmer_partitions, " partitions per rank, spilled to ",
+                 (kmer_spill_dir.empty() ? string("the per rank directories") : kmer_spill_dir), "\n");
+  }
+
+  if (load_kmers && load_kmers_binary()) {
+    // the table is complete, so only the store for lookups is needed
+    kmers_loaded = true;
+    kmer_store.set_size("kmers", max_kmer_store_bytes, max_rpcs_in_flight, useHHSS);
+    barrier();
+    return;
+  }
+
+  my_num_kmers = estimate_num_kmers(packed_reads_list, balance_kmer_targets);
   // check if we have enough memory to run - conservative because we don't want to run out of memory
-  double adjustment_factor = 0.2;
-  auto my_adjusted_num_kmers = my_num_kmers * adjustment_factor;
-  double required_space = estimate_hashtable_memory(my_adjusted_num_kmers, sizeof(Kmer<MAX_K>) + sizeof(KmerCounts)) * node0_cores;
-  auto max_reqd_space = upcxx::reduce_all(required_space, upcxx::op_fast_max).wait();
+  double required_space = estimate_hashtable_memory(my_num_kmers, sizeof(Kmer<MAX_K>) + sizeof(KmerCounts));
+  auto node_reqd_space = upcxx::reduce_all(required_space, upcxx::op_fast_add, local_team()).wait();
+  auto max_reqd_space = upcxx::reduce_all(node_reqd_space, upcxx::op_fast_max).wait();
   auto free_mem = get_free_mem();
   auto lowest_free_mem = upcxx::reduce_all(free_mem, upcxx::op_fast_min).wait();
   auto highest_free_mem = upcxx::reduce_all(free_mem, upcxx::op_fast_max).wait();
-  SLOG_VERBOSE("With adjustment factor of ", adjustment_factor, " require ", get_size_str(max_reqd_space), " per node (",
-               my_adjusted_num_kmers, " kmers per rank), and there is ", get_size_str(lowest_free_mem), " to ",
+  SLOG_VERBOSE("Require up to ", get_size_str(max_reqd_space), " per node, and there is ", get_size_str(lowest_free_mem), " to ",
                get_size_str(highest_free_mem), " available on the nodes\n");
-  if (lowest_free_mem * 0.80 < max_reqd_space) SWARN("Insufficient memory available: this could crash with OOM (lowest=", get_size_str(lowest_free_mem), " vs reqd=", get_size_str(max_reqd_space), ")");
+  if (lowest_free_mem * 0.80 < max_reqd_space)
+    SWARN("Insufficient memory available: this could crash with OOM (lowest=", get_size_str(lowest_free_mem),
+          " vs reqd=", get_size_str(max_reqd_space), ")", (this->num_kmer_partitions == 1 ? "; try --kmer-partitions" : ""));
 
   kmer_store.set_size("kmers", max_kmer_store_bytes, max_rpcs_in_flight, useHHSS);
 
   barrier();
-  // in this case we have to roughly estimate the hash table size because the space is reserved now
-  // err on the side of excess because the whole point of doing this is speed and we don't want a
-  // hash table resize
-  // Unfortunately, this estimate depends on the depth of the sample - high depth means more wasted memory,
-  // but low depth means potentially resizing the hash table, which is very expensive
-  double kmers_space_reserved = my_adjusted_num_kmers * (sizeof(Kmer<MAX_K>) + sizeof(KmerCounts));
-  SLOG_VERBOSE("Reserving at least ", get_size_str(node0_cores * kmers_space_reserved), " for kmer hash tables with ",
-               node0_cores * my_adjusted_num_kmers, " entries on node 0\n");
-  double init_free_mem = get_free_mem();
-  if (my_adjusted_num_kmers <= 0) DIE("no kmers to reserve space for");
-  kmer_store.set_update_func([&ht_inserter = this->ht_inserter](Supermer supermer) {
-    num_inserts++;
-    ht_inserter->insert_supermer(supermer.seq, supermer.count);
+  if (use_insert_thread && !HashTableInserter<MAX_K>::supports_host_kmer_targets()) {
+    SWARN("Inserting the received kmers on a separate thread is not available on the GPU, inserting them on the main thread");
+  } else if (use_insert_thread) {
+    insert_thread = make_unique<upcxx_utils::ThreadPool>(1);
+    insert_batch.reserve(INSERT_BATCH_SIZE);
+    SLOG_VERBOSE("Inserting the received kmers on a separate thread\n");
+  }
+  kmer_store.set_batch_update_func([this](const SupermerBlock<MAX_K> *blocks, size_t num_blocks) {
+    for (size_t i = 0; i < num_blocks; i++) num_inserts += blocks[i].num_supermers;
+    if (!insert_thread) {
+      insert_received_supermers(blocks, num_blocks);
+      return;
+    }
+    insert_batch.insert(insert_batch.end(), blocks, blocks + num_blocks);
+    if (insert_batch.size() >= INSERT_BATCH_SIZE) enqueue_insert_batch();
   });
-  // this is conservative, actually varies from around 1/2 to 1/5
-  if (use_qf) my_num_kmers *= 0.6;
-  ht_inserter->init(my_num_kmers, use_qf);
+  // the singletons are filtered out by the QF, and without earlier rounds to predict their fraction from, this is conservative,
+  // actually varies from around 1/2 to 1/5
+  if (use_qf) {
+    int64_t predicted_distinct;
+    double predicted_singleton_fraction;
+    if (_kmer_table_sizes.predict(Kmer<MAX_K>::get_k(), predicted_distinct, predicted_singleton_fraction))
+      my_num_kmers *= min(1.0, max(0.2, 1.1 * (1 - predicted_singleton_fraction)));
+    else
+      my_num_kmers *= 0.6;
+  }
+  ht_inserter->init(my_num_kmers, use_qf, use_sort_kcount, use_node_tables, this->num_kmer_partitions, kmer_spill_dir);
+  barrier();
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::report_minimizer_schemes(vector<PackedReads *> &packed_reads_list) {
+  const int max_sample_reads = 10000;
+  auto kmer_len = Kmer<MAX_K>::get_k();
+  auto orig_scheme = _minimizer_scheme;
+  SLOG("Minimizer schemes for k = ", kmer_len, " and minimizer length ", minimizer_len, ":\n");
+  vector<Kmer<MAX_K>> kmers;
+  for (int scheme_i = 0; scheme_i < (int)MINIMIZER_SCHEME_NAMES.size(); scheme_i++) {
+    _minimizer_scheme = (MinimizerScheme)scheme_i;
+    int64_t num_reads = 0;
+    int64_t num_supermers = 0;
+    int64_t num_supermer_kmers = 0;
+    int64_t num_supermer_bytes = 0;
+    vector<int64_t> rank_kmers(rank_n(), 0);
+    for (auto packed_reads : packed_reads_list) {
+      packed_reads->reset();
+      string id, seq, quals;
+      for (int i = 0; i < max_sample_reads; i++) {
+        if (!packed_reads->get_next_read(id, seq, quals)) break;
+        if (seq.length() < kmer_len + 2) continue;
+        num_reads++;
+        Kmer<MAX_K>::get_kmers(kmer_len, seq, kmers);
+        // the same splitting as when sending, over the kmers that have both extensions
+        intrank_t prev_target_rank = -1;
+        int supermer_len = 0;
+        for (int j = 1; j < (int)(seq.length() - kmer_len); j++) {
+          auto kmer_rc = kmers[j].revcomp();
+          auto target_rank = kmers[j].minimizer_hash_fast(minimizer_len, &kmer_rc) % rank_n();
+          rank_kmers[target_rank]++;
+          if (target_rank == prev_target_rank && supermer_len < SupermerChunk<MAX_K>::MAX_BASES) {
+            supermer_len++;
+          } else {
+            if (supermer_len) num_supermer_bytes += get_packed_record_bytes<MAX_K>(supermer_len);
+            num_supermers++;
+            supermer_len = kmer_len + 2;
+            prev_target_rank = target_rank;
+          }
+          num_supermer_kmers++;
+        }
+        if (supermer_len) num_supermer_bytes += get_packed_record_bytes<MAX_K>(supermer_len);
+      }
+    }
+    reduce_all(rank_kmers.data(), rank_kmers.data(), rank_kmers.size(), op_fast_add).wait();
+    auto all_num_reads = reduce_one(num_reads, op_fast_add, 0).wait();
+    auto all_num_supermers = reduce_one(num_supermers, op_fast_add, 0).wait();
+    auto all_num_supermer_kmers = reduce_one(num_supermer_kmers, op_fast_add, 0).wait();
+    auto all_num_supermer_bytes = reduce_one(num_supermer_bytes, op_fast_add, 0).wait();
+    int64_t max_rank_kmers = *max_element(rank_kmers.begin(), rank_kmers.end());
+    double avg_rank_kmers = (double)accumulate(rank_kmers.begin(), rank_kmers.end(), (int64_t)0) / rank_n();
+    if (!all_num_reads || !all_num_supermers) continue;
+    SLOG("  ", left, setw(15), MINIMIZER_SCHEME_NAMES[scheme_i], right, fixed, setprecision(2), " ",
+         (double)all_num_supermers / all_num_reads, " supermers per read, average length ",
+         (double)all_num_supermer_kmers / all_num_supermers, " kmers, ",
+         get_size_str(all_num_supermer_bytes), " sent, load balance ", setprecision(3),
+         (max_rank_kmers ? avg_rank_kmers / max_rank_kmers : 1.0), (scheme_i == (int)orig_scheme ? " (in use)" : ""), "\n");
+  }
+  _minimizer_scheme = orig_scheme;
   barrier();
 }
 
+template <int MAX_K>
+int64_t KmerDHT<MAX_K>::estimate_num_kmers(vector<PackedReads *> &packed_reads_list, bool balance_kmer_targets) {
+  // do not read the entire data set for just an estimate
+  const int max_sample_reads = 100000;
+  auto kmer_len = Kmer<MAX_K>::get_k();
+  // the sketch of half the sample shows how fast new distinct kmers are still being found at the end of the sample
+  HyperLogLog sketch, half_sketch;
+  // kmer occurrences per minimizer bucket when balancing, which give the load on each rank for any assignment of the buckets,
+  // otherwise per target rank
+  int num_buckets = balance_kmer_targets ? MINIMIZER_BUCKETS_PER_RANK * rank_n() : rank_n();
+  vector<int64_t> bucket_counts(num_buckets, 0);
+  int64_t num_reads = 0;
+  int64_t half_num_reads = 0;
+  int64_t tot_num_reads = 0;
+  vector<Kmer<MAX_K>> kmers;
+  for (int lib_i = 0; lib_i < (int)packed_reads_list.size(); lib_i++) {
+    auto packed_reads = packed_reads_list[lib_i];
+    packed_reads->reset();
+    string id, seq, quals;
+    for (int64_t read_i = 0; read_i < packed_reads->get_local_num_reads(); read_i++) {
+      if (_diginorm_reads.is_kept(lib_i, read_i)) tot_num_reads++;
+    }
+    for (int i = 0; i < max_sample_reads; i++) {
+      if (!packed_reads->get_next_read(id, seq, quals)) break;
+      if (!_diginorm_reads.is_kept(lib_i, packed_reads->get_read_index() - 1)) continue;
+      if (seq.length() < kmer_len) continue;
+      Kmer<MAX_K>::get_kmers(kmer_len, seq, kmers);
+      bool in_half = (num_reads % 2 == 0);
+      if (in_half) half_num_reads++;
+      for (auto &kmer : kmers) {
+        auto kmer_rc = kmer.revcomp();
+        if (kmer_rc < kmer) kmer = kmer_rc;
+        auto hash = kmer.hash();
+        sketch.add(hash);
+        if (in_half) half_sketch.add(hash);
+        if (balance_kmer_targets)
+          bucket_counts[kmer.minimizer_hash_fast(minimizer_len) % num_buckets]++;
+        else
+          bucket_counts[get_kmer_target_rank(kmer)]++;
+      }
+      num_reads++;
+    }
+  }
+  sketch.merge_all();
+  half_sketch.merge_all();
+  reduce_all(bucket_counts.data(), bucket_counts.data(), bucket_counts.size(), op_fast_add).wait();
+  if (balance_kmer_targets) balance_minimizer_buckets(bucket_counts);
+  int64_t my_num_sampled_kmers = 0;
+  for (int i = 0; i < num_buckets; i++) {
+    if (get_bucket_target_rank(i) == rank_me()) my_num_sampled_kmers += bucket_counts[i];
+  }
+  auto all_num_reads = reduce_all(num_reads, op_fast_add).wait();
+  auto all_half_num_reads = reduce_all(half_num_reads, op_fast_add).wait();
+  auto all_tot_num_reads = reduce_all(tot_num_reads, op_fast_add).wait();
+  int64_t all_num_kmers = 0;
+  for (auto count : bucket_counts) all_num_kmers += count;
+  if (!all_num_reads || !all_num_kmers) return MIN_EST_KMERS_PER_RANK;
+  double sample_distinct = sketch.estimate();
+  // most of the new kmers at the end of the sample come from errors, which keep growing linearly with the number of reads,
+  // whereas the rate for the rest falls off, so this extrapolation is an upper bound
+  double new_per_read = (all_num_reads > all_half_num_reads ? max(0.0, sample_distinct - half_sketch.estimate()) /
+                                                                   (all_num_reads - all_half_num_reads)
+                                                             : 0);
+  double all_distinct = sample_distinct + new_per_read * (all_tot_num_reads - all_num_reads);
+  // there can never be more distinct kmers than kmers
+  all_distinct = min(all_distinct, (double)all_num_kmers * all_tot_num_reads / all_num_reads);
+  // the histograms of the earlier rounds give a tighter estimate than the sample, but if the last round dropped kmers for lack of
+  // memory its histogram is short of them, so then the prediction can only raise the estimate
+  int64_t predicted_distinct;
+  double predicted_singleton_fraction;
+  if (_kmer_table_sizes.predict(kmer_len, predicted_distinct, predicted_singleton_fraction)) {
+    bool dropped_kmers = _kmer_table_sizes.last_round_dropped_kmers();
+    SLOG_VERBOSE("Estimated ", (int64_t)all_distinct, " distinct kmers from the sample and ", predicted_distinct,
+                 " from the earlier rounds", (dropped_kmers ? ", which dropped kmers" : ""), "\n");
+    all_distinct = dropped_kmers ? max(all_distinct, (double)predicted_distinct) : predicted_distinct;
+  }
+  int64_t my_distinct = all_distinct * my_num_sampled_kmers / all_num_kmers;
+  my_distinct = max(my_distinct, max(MIN_EST_KMERS_PER_RANK, (int64_t)(MIN_EST_KMERS_AVG_FRACTION * all_distinct / rank_n())));
+  auto max_distinct = reduce_one(my_distinct, op_fast_max, 0).wait();
+  SLOG_VERBOSE("Sampled ", perc_str(all_num_reads, all_tot_num_reads), " reads, and estimated ", (int64_t)all_distinct,
+               " distinct kmers, average per rank ", (int64_t)all_distinct / rank_n(), " max ", max_distinct, "\n");
+  return my_distinct;
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::insert_received_supermers(const SupermerBlock<MAX_K> *blocks, size_t num_blocks) {
+  received_supermers.clear();
+  for (size_t i = 0; i < num_blocks; i++) blocks[i].get_supermers(received_supermers);
+  if (num_kmer_partitions == 1) {
+    ht_inserter->insert_supermers(received_supermers.data(), received_supermers.size());
+    return;
+  }
+  for (auto &supermer : received_supermers) ht_inserter->spill_supermer(supermer, get_supermer_partition(supermer));
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::enqueue_insert_batch() {
+  if (insert_batch.empty()) return;
+  // This is called from the update func, in an rpc, so it never waits. The queue is bounded by wait_for_insert_slots instead.
+  num_pending_insert_batches++;
+  auto batch = make_shared<vector<SupermerBlock<MAX_K>>>();
+  batch->swap(insert_batch);
+  insert_batch.reserve(INSERT_BATCH_SIZE);
+  // the thread pool has a single thread, so the batches are inserted one at a time in the order they were received
+  auto fut = insert_thread->enqueue_no_return([this, batch]() {
+    insert_received_supermers(batch->data(), batch->size());
+    num_pending_insert_batches--;
+  });
+  insert_batches_fut = when_all(insert_batches_fut, fut);
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::wait_for_insert_slots() {
+  if (!insert_thread || num_pending_insert_batches < MAX_PENDING_INSERT_BATCHES) return;
+  // Only the internal progress is made while waiting, so no more batches are received, and the ranks sending to this one are
+  // held back by their limits on the rpcs in flight. The insert thread drains the queue without any progress on this rank.
+  num_insert_batch_waits++;
+  while (num_pending_insert_batches >= MAX_PENDING_INSERT_BATCHES) progress(progress_level::internal);
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::wait_for_insert_thread() {
+  if (!insert_thread) return;
+  enqueue_insert_batch();
+  insert_batches_fut.wait();
+  insert_batches_fut = make_future();
+  auto all_num_waits = reduce_one(num_insert_batch_waits, op_fast_add, 0).wait();
+  if (all_num_waits) SLOG_VERBOSE("Waited for the insert thread ", all_num_waits, " times\n");
+  num_insert_batch_waits = 0;
+}
+
 template <int MAX_K>
 void KmerDHT<MAX_K>::clear_stores() {
   kmer_store.clear();
@@ -162,6 +586,9 @@ template <int MAX_K>
 KmerDHT<MAX_K>::~KmerDHT() {
   local_kmers->clear();
   KmerMap<MAX_K>().swap(*local_kmers);
+  static_index->clear();
+  vector<global_ptr<FragElem>>().swap(visited_frags);
+  HASH_TABLE<global_ptr<FragElem>, uint32_t>().swap(visited_frag_idxs);
   clear_stores();
 }
 
@@ -178,25 +605,115 @@ int KmerDHT<MAX_K>::get_minimizer_len() {
 
 template <int MAX_K>
 uint64_t KmerDHT<MAX_K>::get_num_kmers(bool all) {
+  uint64_t num_kmers = local_kmers->size() + static_index->size();
   if (!all)
-    return reduce_one((uint64_t)local_kmers->size(), op_fast_add, 0).wait();
+    return reduce_one(num_kmers, op_fast_add, 0).wait();
   else
-    return reduce_all((uint64_t)local_kmers->size(), op_fast_add).wait();
+    return reduce_all(num_kmers, op_fast_add).wait();
 }
 
 template <int MAX_K>
 int64_t KmerDHT<MAX_K>::get_local_num_kmers(void) {
-  return local_kmers->size();
+  return local_kmers->size() + static_index->size();
 }
 
 template <int MAX_K>
 upcxx::intrank_t KmerDHT<MAX_K>::get_kmer_target_rank(const Kmer<MAX_K> &kmer, const Kmer<MAX_K> *kmer_rc) const {
   assert(&kmer != kmer_rc && "Can be a palindrome, cannot be the same Kmer instance");
-  return kmer.minimizer_hash_fast(minimizer_len, kmer_rc) % rank_n();
+  return get_minimizer_target_rank(kmer, kmer.minimizer_hash_fast(minimizer_len, kmer_rc), kmer_rc);
+}
+
+template <int MAX_K>
+int64_t KmerDHT<MAX_K>::get_kmer_target(const Kmer<MAX_K> &kmer, const Kmer<MAX_K> *kmer_rc) const {
+  assert(&kmer != kmer_rc && "Can be a palindrome, cannot be the same Kmer instance");
+  auto minimizer_hash = kmer.minimizer_hash_fast(minimizer_len, kmer_rc);
+  int64_t target_rank = get_minimizer_target_rank(kmer, minimizer_hash, kmer_rc);
+  if (num_kmer_partitions == 1) return target_rank;
+  // rehashed so the partitions are independent of the bits of the hash that choose the rank
+  return target_rank * num_kmer_partitions + quick_hash(minimizer_hash) % num_kmer_partitions;
+}
+
+template <int MAX_K>
+int KmerDHT<MAX_K>::get_supermer_partition(const SupermerChunk<MAX_K> &supermer) {
+  // all the kmers in a supermer are in the same partition, and the first kmer is only there for its right extension
+  auto kmer_len = Kmer<MAX_K>::get_k();
+  auto packed = supermer.get_packed_view();
+  Kmer<MAX_K>::get_kmers_from_packed(kmer_len, packed.bases, kmer_len + 1, partition_kmers_buf);
+  auto kmer = partition_kmers_buf[1];
+  auto kmer_rc = kmer.revcomp();
+  if (kmer_rc < kmer) kmer = kmer_rc;
+  return get_kmer_target(kmer) % num_kmer_partitions;
+}
+
+template <int MAX_K>
+upcxx::intrank_t KmerDHT<MAX_K>::get_minimizer_target_rank(const Kmer<MAX_K> &kmer, uint64_t minimizer_hash,
+                                                           const Kmer<MAX_K> *kmer_rc) const {
+  if (node_first_targets) {
+    // ranks are numbered consecutively within each node, as in split_rank
+    auto node = fastrange32(kmer.minimizer_hash_fast(NODE_MINIMIZER_LEN, kmer_rc) >> 32, num_target_nodes);
+    return node * num_target_threads + fastrange32(minimizer_hash >> 32, num_target_threads);
+  }
+  if (bucket_target_ranks.empty()) return minimizer_hash % rank_n();
+  return bucket_target_ranks[minimizer_hash % bucket_target_ranks.size()];
+}
+
+template <int MAX_K>
+int KmerDHT<MAX_K>::get_num_minimizer_buckets() const {
+  return bucket_target_ranks.empty() ? rank_n() : bucket_target_ranks.size();
+}
+
+template <int MAX_K>
+upcxx::intrank_t KmerDHT<MAX_K>::get_bucket_target_rank(int bucket) const {
+  return bucket_target_ranks.empty() ? bucket : bucket_target_ranks[bucket];
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::balance_minimizer_buckets(const vector<int64_t> &bucket_counts) {
+  // The bucket counts are the same on all ranks after the reduction, so every rank computes the same assignment without
+  // needing a broadcast. Buckets default to the same rank as plain hashing, because the number of buckets is a multiple of the
+  // number of ranks.
+  int num_buckets = bucket_counts.size();
+  int64_t tot_count = 0;
+  for (auto count : bucket_counts) tot_count += count;
+  int64_t heavy_threshold = 2 * tot_count / num_buckets;
+  vector<int64_t> rank_loads(rank_n(), 0);
+  vector<int> heavy_buckets;
+  bucket_target_ranks.resize(num_buckets);
+  for (int i = 0; i < num_buckets; i++) {
+    bucket_target_ranks[i] = i % rank_n();
+    if (bucket_counts[i] > heavy_threshold)
+      heavy_buckets.push_back(i);
+    else
+      rank_loads[i % rank_n()] += bucket_counts[i];
+  }
+  auto get_balance = [](const vector<int64_t> &loads) {
+    int64_t max_load = *max_element(loads.begin(), loads.end());
+    return max_load ? (double)accumulate(loads.begin(), loads.end(), (int64_t)0) / loads.size() / max_load : 1.0;
+  };
+  vector<int64_t> hashed_loads = rank_loads;
+  for (auto bucket : heavy_buckets) hashed_loads[bucket % rank_n()] += bucket_counts[bucket];
+  // greedy bin packing: the heaviest remaining bucket goes to the least loaded rank
+  sort(heavy_buckets.begin(), heavy_buckets.end(), [&bucket_counts](int b1, int b2) {
+    return bucket_counts[b1] > bucket_counts[b2] || (bucket_counts[b1] == bucket_counts[b2] && b1 < b2);
+  });
+  using LoadAndRank = pair<int64_t, upcxx::intrank_t>;
+  priority_queue<LoadAndRank, vector<LoadAndRank>, greater<LoadAndRank>> least_loaded;
+  for (upcxx::intrank_t i = 0; i < rank_n(); i++) least_loaded.push({rank_loads[i], i});
+  for (auto bucket : heavy_buckets) {
+    auto target_rank = least_loaded.top().second;
+    least_loaded.pop();
+    bucket_target_ranks[bucket] = target_rank;
+    rank_loads[target_rank] += bucket_counts[bucket];
+    least_loaded.push({rank_loads[target_rank], target_rank});
+  }
+  SLOG_VERBOSE("Reassigned ", heavy_buckets.size(), " heavy minimizer buckets out of ", num_buckets,
+               ", expected kmer balance improved from ", fixed, setprecision(3), get_balance(hashed_loads), " to ",
+               get_balance(rank_loads), "\n");
 }
 
 template <int MAX_K>
 KmerCounts *KmerDHT<MAX_K>::get_local_kmer_counts(Kmer<MAX_K> &kmer) {
+  if (static_index->size()) return static_index->find(kmer);
   const auto it = local_kmers->find(kmer);
   if (it == local_kmers->end()) return nullptr;
   return &it->second;
@@ -209,30 +726,234 @@ bool KmerDHT<MAX_K>::kmer_exists(Kmer<MAX_K> kmer_fw) {
 
   return rpc(
              get_kmer_target_rank(kmer_fw, &kmer_rc),
-             [](Kmer<MAX_K> kmer, dist_object<KmerMap<MAX_K>> &local_kmers) -> bool {
+             [](Kmer<MAX_K> kmer, dist_object<KmerMap<MAX_K>> &local_kmers,
+                dist_object<StaticKmerIndex<MAX_K>> &static_index) -> bool {
+               if (static_index->size()) return static_index->find(kmer) != nullptr;
                const auto it = local_kmers->find(kmer);
                if (it == local_kmers->end()) return false;
                return true;
              },
-             *kmer, local_kmers)
+             *kmer, local_kmers, static_index)
       .wait();
 }
 
+template <int MAX_K>
+future<vector<KmerLookup>> KmerDHT<MAX_K>::lookup_kmers(const vector<Kmer<MAX_K>> &kmers) {
+  // the canonical kmers for each target rank, with their positions in the batch, complemented if the kmer was revcomped
+  struct TargetKmers {
+    vector<Kmer<MAX_K>> kmers;
+    vector<int64_t> positions;
+  };
+  HASH_TABLE<intrank_t, TargetKmers> target_kmers;
+  for (int64_t i = 0; i < (int64_t)kmers.size(); i++) {
+    const Kmer<MAX_K> kmer_rc = kmers[i].revcomp();
+    bool is_rc = kmer_rc < kmers[i];
+    auto &target = target_kmers[get_kmer_target_rank(kmers[i], &kmer_rc)];
+    target.kmers.push_back(is_rc ? kmer_rc : kmers[i]);
+    target.positions.push_back(is_rc ? ~i : i);
+  }
+  auto lookups = make_shared<vector<KmerLookup>>(kmers.size());
+  future<> fut_all = make_future();
+  for (auto &[target_rank, target] : target_kmers) {
+    auto fut = rpc(
+                   target_rank,
+                   [](view<Kmer<MAX_K>> kmers, dist_object<KmerMap<MAX_K>> &local_kmers,
+                      dist_object<StaticKmerIndex<MAX_K>> &static_index) {
+                     vector<KmerLookup> lookups;
+                     lookups.reserve(kmers.size());
+                     for (auto &kmer : kmers) {
+                       KmerCounts *kmer_counts = nullptr;
+                       if (static_index->size()) {
+                         kmer_counts = static_index->find(kmer);
+                       } else {
+                         auto it = local_kmers->find(kmer);
+                         if (it != local_kmers->end()) kmer_counts = &it->second;
+                       }
+                       if (kmer_counts)
+                         lookups.push_back({.found = true,
+                                            .count = kmer_counts->count,
+                                            .left_ext = kmer_counts->get_left_ext(),
+                                            .right_ext = kmer_counts->get_right_ext()});
+                       else
+                         lookups.push_back({.found = false, .count = 0, .left_ext = 'X', .right_ext = 'X'});
+                     }
+                     return lookups;
+                   },
+                   make_view(target.kmers), local_kmers, static_index)
+                   .then([lookups, positions = std::move(target.positions)](const vector<KmerLookup> &target_lookups) {
+                     for (size_t i = 0; i < positions.size(); i++) {
+                       auto lookup = target_lookups[i];
+                       if (positions[i] < 0) {
+                         // the extensions of the revcomp are the complements of the canonical ones, swapped
+                         auto comp_ext = [](char ext) { return (ext == 'F' || ext == 'X') ? ext : comp_nucleotide(ext); };
+                         swap(lookup.left_ext, lookup.right_ext);
+                         lookup.left_ext = comp_ext(lookup.left_ext);
+                         lookup.right_ext = comp_ext(lookup.right_ext);
+                       }
+                       (*lookups)[positions[i] < 0 ? ~positions[i] : positions[i]] = lookup;
+                     }
+                   });
+    fut_all = when_all(fut_all, fut);
+  }
+  return fut_all.then([lookups]() { return std::move(*lookups); });
+}
+
+template <int MAX_K>
+uint32_t KmerDHT<MAX_K>::get_frag_idx(global_ptr<FragElem> frag_elem_gptr) {
+  const auto it = visited_frag_idxs.find(frag_elem_gptr);
+  if (it != visited_frag_idxs.end()) return it->second;
+  if (visited_frags.size() >= numeric_limits<uint32_t>::max() - 1) DIE("Too many fragments visiting kmers on this rank");
+  visited_frags.push_back(frag_elem_gptr);
+  uint32_t frag_idx = visited_frags.size();
+  visited_frag_idxs.insert({frag_elem_gptr, frag_idx});
+  return frag_idx;
+}
+
+template <int MAX_K>
+uint32_t KmerDHT<MAX_K>::find_frag_idx(global_ptr<FragElem> frag_elem_gptr) const {
+  const auto it = visited_frag_idxs.find(frag_elem_gptr);
+  return (it != visited_frag_idxs.end() ? it->second : 0);
+}
+
+template <int MAX_K>
+global_ptr<FragElem> KmerDHT<MAX_K>::get_frag_gptr(uint32_t frag_idx) {
+  if (!frag_idx) return nullptr;
+  assert(frag_idx <= visited_frags.size());
+  return visited_frags[frag_idx - 1];
+}
+
 template <int MAX_K>
 void KmerDHT<MAX_K>::add_supermer(Supermer &supermer, int target_rank) {
-  kmer_store.update(target_rank, supermer);
+  // ctg kmer counts are not additive, so only supermers from reads are combined
+  if (!supermer_cache.capacity() || using_ctg_kmers) {
+    send_supermer(supermer, target_rank);
+    return;
+  }
+  num_supermers_added++;
+  auto hash = std::hash<string>{}(supermer.seq);
+  auto it = supermer_cache.find(supermer.seq, hash);
+  if (it != supermer_cache.end()) {
+    int count = it->second.count + supermer.count;
+    if (count <= numeric_limits<kmer_count_t>::max()) {
+      it->second.count = count;
+      num_supermers_combined++;
+    } else {
+      // the combined count would overflow, so send what has been combined so far and start again
+      Supermer combined_supermer = {.seq = supermer.seq, .count = it->second.count};
+      send_supermer(combined_supermer, target_rank);
+      it->second.count = supermer.count;
+    }
+    return;
+  }
+  if (supermer_cache.replace(supermer.seq, {supermer.count, target_rank}, hash, true) != supermer_cache.end()) return;
+  // all the nearby slots are full, so evict the entry in the home slot (random replacement) and take its place
+  typename decltype(supermer_cache)::iterator victim(supermer_cache, hash & (supermer_cache.capacity() - 1));
+  Supermer evicted_supermer = {.seq = victim->first, .count = victim->second.count};
+  send_supermer(evicted_supermer, victim->second.target_rank);
+  supermer_cache.erase(victim);
+  supermer_cache.replace(supermer.seq, {supermer.count, target_rank}, hash, true);
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::send_supermer(const Supermer &supermer, int target_rank) {
+  // the ctg kmers have to go to the owner, because they are inserted without locking
+  if (!using_ctg_kmers && local_team_contains(target_rank) && ht_inserter->has_node_tables()) {
+    SupermerChunk<MAX_K> supermer_chunk;
+    supermer_chunk.set(supermer);
+    ht_inserter->insert_supermer_into_node_table(supermer_chunk, target_rank);
+    return;
+  }
+  auto &block = send_blocks[target_rank];
+  if (block.add(supermer)) return;
+  send_block(target_rank);
+  block.add(supermer);
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::send_block(int target_rank) {
+  auto &block = send_blocks[target_rank];
+  num_blocks_sent++;
+  num_block_bytes_used += block.num_bytes;
+  // the backpressure from the insert thread is applied here, when sending, rather than in the rpcs that receive the batches
+  wait_for_insert_slots();
+  kmer_store.update(target_rank, block);
+  block.clear();
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::flush_supermer_cache() {
+  if (!supermer_cache.capacity()) return;
+  for (auto &elem : supermer_cache) {
+    Supermer supermer = {.seq = elem.first, .count = elem.second.count};
+    send_supermer(supermer, elem.second.target_rank);
+  }
+  supermer_cache.clear();
+  auto all_num_added = reduce_one(num_supermers_added, op_fast_add, 0).wait();
+  auto all_num_combined = reduce_one(num_supermers_combined, op_fast_add, 0).wait();
+  if (all_num_added) SLOG_VERBOSE("Combined ", perc_str(all_num_combined, all_num_added), " supermers before sending\n");
+  num_supermers_added = 0;
+  num_supermers_combined = 0;
 }
 
 template <int MAX_K>
 void KmerDHT<MAX_K>::flush_updates() {
+  flush_supermer_cache();
+  for (int i = 0; i < (int)send_blocks.size(); i++) {
+    if (send_blocks[i].num_bytes) send_block(i);
+  }
   kmer_store.flush_updates();
   barrier();
+  auto all_num_blocks = reduce_one(num_blocks_sent, op_fast_add, 0).wait();
+  auto all_num_bytes_used = reduce_one(num_block_bytes_used, op_fast_add, 0).wait();
+  if (all_num_blocks)
+    SLOG_VERBOSE("Sent supermers in ", all_num_blocks, " blocks of ", sizeof(SupermerBlock<MAX_K>), " bytes, ",
+                 perc_str(all_num_bytes_used, all_num_blocks * sizeof(SupermerBlock<MAX_K>)), " used\n");
+  num_blocks_sent = 0;
+  num_block_bytes_used = 0;
+  // everything has been received by now, but it may not have been inserted yet
+  wait_for_insert_thread();
   ht_inserter->flush_inserts();
 }
 
 template <int MAX_K>
-void KmerDHT<MAX_K>::finish_updates() {
-  ht_inserter->insert_into_local_hashtable(local_kmers);
+void KmerDHT<MAX_K>::finish_updates(bool dump_tables) {
+  KmerHistogram histogram;
+  if (dump_tables && !HashTableInserter<MAX_K>::supports_host_kmer_targets()) {
+    SWARN("The binary kmer tables cannot be dumped on the GPU, which chooses the kmer extensions on the device");
+    dump_tables = false;
+  }
+  if (dump_tables)
+    insert_into_local_hashtable_and_dump(histogram);
+  else
+    ht_inserter->insert_into_local_hashtable(local_kmers, histogram);
+  add_kmer_histogram(histogram);
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::add_kmer_histogram(KmerHistogram &histogram) {
+  histogram.merge_all();
+  int kmer_len = Kmer<MAX_K>::get_k();
+  _kmer_table_sizes.add(kmer_len, histogram);
+  auto num_distinct = histogram.get_num_distinct();
+  SLOG_VERBOSE("Kmer histogram for k = ", kmer_len, ": ", num_distinct, " distinct kmers, ",
+               perc_str(histogram.get_num_singletons(), num_distinct), " singletons, ", histogram.get_num_solid(), " solid\n");
+  if (!rank_me()) histogram.write("kmer-histogram-" + to_string(kmer_len) + ".txt");
+}
+
+template <int MAX_K>
+void KmerDHT<MAX_K>::build_static_index() {
+  int64_t ht_bytes = estimate_hashtable_memory(local_kmers->size(), sizeof(Kmer<MAX_K>) + sizeof(KmerCounts));
+  static_index->build(*local_kmers);
+  int64_t num_kmers = static_index->size();
+  int64_t index_bytes = static_index->get_index_bytes();
+  auto all_num_kmers = reduce_one(num_kmers, op_fast_add, 0).wait();
+  auto all_index_bytes = reduce_one(index_bytes, op_fast_add, 0).wait();
+  auto all_ht_bytes = reduce_one(ht_bytes, op_fast_add, 0).wait();
+  auto all_entry_bytes = all_num_kmers * (sizeof(Kmer<MAX_K>) + sizeof(KmerCounts));
+  SLOG_VERBOSE("Built static kmer index for ", all_num_kmers, " kmers with ",
+               (all_num_kmers ? 8.0 * all_index_bytes / all_num_kmers : 0.0), " bits per kmer (",
+               get_size_str(all_index_bytes + all_entry_bytes), " in place of ", get_size_str(all_ht_bytes), ")\n");
+  barrier();
 }
 
 // one line per kmer, format:
@@ -249,22 +970,188 @@ void KmerDHT<MAX_K>::dump_kmers() {
   ostringstream out_buf;
   
   int64_t i = 0;
-  for (auto &elem : *local_kmers) {
-    out_buf << elem.first << " " << elem.second.count << " " << elem.second.left << " " << elem.second.right;
+  for_each_local_kmer([&](const Kmer<MAX_K> &kmer, KmerCounts &kmer_counts) {
+    out_buf << kmer << " " << kmer_counts.count << " " << kmer_counts.get_left_ext() << " " << kmer_counts.get_right_ext();
     out_buf << endl;
     i++;
     if (!(i % 1000)) {
       dump_file << out_buf.str();
       out_buf = ostringstream();
     }
-    
-  }
+  });
   if (!out_buf.str().empty()) dump_file << out_buf.str();
   dump_file.close();
   
   SLOG_VERBOSE("Dumped ", this->get_num_kmers(), " kmers\n");
 }
 
+// The header of a binary kmer table file. The routing of kmers to ranks is stored with it, so that a reloaded table is looked up
+// on the same ranks that it was counted on. The minimizer bucket targets follow the header, then the records, then the bins of
+// the kmer histogram of this rank, which also counts the kmers that were not dumped because they are always purged.
+struct KmerTableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t kmer_len;
+  uint32_t record_bytes;
+  uint32_t num_ranks;
+  uint32_t minimizer_len;
+  uint32_t node_first_targets;
+  uint32_t num_target_nodes;
+  uint32_t num_target_threads;
+  uint32_t num_bucket_target_ranks;
+  uint32_t minimizer_scheme;
+  uint32_t num_histogram_bins;
+  uint64_t num_records;
+  uint64_t num_dropped;
+};
+
+static const char KMER_TABLE_MAGIC[8] = {'M', 'H', 'M', 'K', 'M', 'E', 'R', 'S'};
+static const uint32_t KMER_TABLE_VERSION = 2;
+
+static string get_kmer_table_fname(int kmer_len) {
+  string fname = "kmers-" + to_string(kmer_len) + ".bin";
+  get_rank_path(fname, rank_me());
+  return fname;
+}
+
+// the records are 8 byte aligned for reading in place from the mapped file
+static int64_t get_kmer_table_records_offset(int num_bucket_target_ranks) {
+  return (sizeof(KmerTableHeader) + num_bucket_target_ranks * sizeof(int32_t) + 7) / 8 * 8;
+}
+
+// the records are written before the extensions are chosen, so that the run loading them chooses the extensions with its own min
+// depth threshold
+template <int MAX_K>
+void KmerDHT<MAX_K>::insert_into_local_hashtable_and_dump(KmerHistogram &histogram) {
+  auto fname = get_kmer_table_fname(Kmer<MAX_K>::get_k());
+  // zeroed so that any padding is written deterministically
+  KmerTableHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KMER_TABLE_MAGIC, sizeof(header.magic));
+  header.version = KMER_TABLE_VERSION;
+  header.kmer_len = Kmer<MAX_K>::get_k();
+  header.record_bytes = sizeof(KmerTableRecord<MAX_K>);
+  header.num_ranks = rank_n();
+  header.minimizer_len = minimizer_len;
+  header.node_first_targets = node_first_targets;
+  header.num_target_nodes = num_target_nodes;
+  header.num_target_threads = num_target_threads;
+  header.num_bucket_target_ranks = bucket_target_ranks.size();
+  header.minimizer_scheme = (uint32_t)_minimizer_scheme;
+  header.num_histogram_bins = histogram.get_num_bins();
+  // the number of records and the number dropped are only known at the end, when the header is written again
+  header.num_records = 0;
+  ofstream dump_file(fname, ios::binary);
+  if (!dump_file) DIE("Could not open ", fname, " for writing");
+  dump_file.write((const char *)&header, sizeof(header));
+  vector<int32_t> targets(bucket_target_ranks.begin(), bucket_target_ranks.end());
+  targets.resize((get_kmer_table_records_offset(targets.size()) - sizeof(header)) / sizeof(int32_t), 0);
+  dump_file.write((const char *)targets.data(), targets.size() * sizeof(int32_t));
+  // every rank writes its own file at the same time, in large blocks of records
+  vector<KmerTableRecord<MAX_K>> records;
+  records.reserve(100000);
+  auto write_records = [&dump_file, &records, &header]() {
+    dump_file.write((const char *)records.data(), records.size() * sizeof(KmerTableRecord<MAX_K>));
+    header.num_records += records.size();
+    records.clear();
+  };
+  ht_inserter->insert_into_local_hashtable(local_kmers, histogram, [&](const KmerTableRecord<MAX_K> &record) {
+    records.push_back(record);
+    if (records.size() == records.capacity()) write_records();
+  });
+  write_records();
+  // the local bins, which are merged over all the ranks when the table is loaded
+  for (int i = 0; i < histogram.get_num_bins(); i++) {
+    int64_t num_kmers = histogram.get_num_kmers(i);
+    dump_file.write((const char *)&num_kmers, sizeof(num_kmers));
+  }
+  header.num_dropped = histogram.get_num_dropped();
+  dump_file.seekp(0);
+  dump_file.write((const char *)&header, sizeof(header));
+  dump_file.close();
+  if (!dump_file) DIE("Could not write ", fname);
+  auto all_num_records = reduce_one(header.num_records, op_fast_add, 0).wait();
+  auto all_bytes = reduce_one(get_kmer_table_records_offset(header.num_bucket_target_ranks) +
+                                  header.num_records * sizeof(KmerTableRecord<MAX_K>) + header.num_histogram_bins * sizeof(int64_t),
+                              op_fast_add, 0)
+                       .wait();
+  SLOG_VERBOSE("Dumped ", all_num_records, " kmers with their extension counts into binary tables of ", get_size_str(all_bytes),
+               "\n");
+}
+
+template <int MAX_K>
+bool KmerDHT<MAX_K>::load_kmers_binary() {
+  auto fname = get_kmer_table_fname(Kmer<MAX_K>::get_k());
+  int fd = open(fname.c_str(), O_RDONLY);
+  struct stat file_stat;
+  KmerTableHeader header;
+  bool valid = false;
+  bool minimizers_differ = false;
+  if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size >= (off_t)sizeof(header) &&
+      pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+    valid = !memcmp(header.magic, KMER_TABLE_MAGIC, sizeof(header.magic)) && header.version == KMER_TABLE_VERSION &&
+            header.kmer_len == Kmer<MAX_K>::get_k() && header.record_bytes == sizeof(KmerTableRecord<MAX_K>) &&
+            header.num_ranks == rank_n() && header.minimizer_scheme < MINIMIZER_SCHEME_NAMES.size() &&
+            header.num_histogram_bins == (uint32_t)KmerHistogram().get_num_bins() &&
+            file_stat.st_size == get_kmer_table_records_offset(header.num_bucket_target_ranks) +
+                                     (off_t)(header.num_records * sizeof(KmerTableRecord<MAX_K>)) +
+                                     (off_t)(header.num_histogram_bins * sizeof(int64_t));
+    // the kmers are only where the lookups expect them if they were routed with the same minimizers as this run uses
+    minimizers_differ = valid && (header.minimizer_scheme != (uint32_t)_minimizer_scheme || header.minimizer_len != minimizer_len);
+    if (minimizers_differ) valid = false;
+  }
+  // all the ranks load or none do, since the table is only usable if it is complete
+  auto all_valid = reduce_all((int)valid, op_fast_min).wait();
+  auto any_exist = reduce_all((int)(fd >= 0), op_fast_max).wait();
+  auto any_minimizers_differ = reduce_all((int)minimizers_differ, op_fast_max).wait();
+  if (!all_valid) {
+    if (fd >= 0) close(fd);
+    if (any_minimizers_differ)
+      SWARN("Not loading the binary kmer tables for k = ", Kmer<MAX_K>::get_k(),
+            ": they were written with a different minimizer scheme or length than the ",
+            minimizer_scheme_to_string(_minimizer_scheme), " scheme and length ", minimizer_len, " used by this run");
+    else if (any_exist)
+      SWARN("Not loading the binary kmer tables for k = ", Kmer<MAX_K>::get_k(),
+            ": some are missing, or they were written with a different number of processes");
+    return false;
+  }
+  auto buf = (const uint8_t *)mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buf == MAP_FAILED) DIE("Could not map ", fname, ": ", strerror(errno));
+  madvise((void *)buf, file_stat.st_size, MADV_SEQUENTIAL);
+  node_first_targets = header.node_first_targets;
+  num_target_nodes = header.num_target_nodes;
+  num_target_threads = header.num_target_threads;
+  auto targets = (const int32_t *)(buf + sizeof(header));
+  bucket_target_ranks.assign(targets, targets + header.num_bucket_target_ranks);
+  auto records = (const KmerTableRecord<MAX_K> *)(buf + get_kmer_table_records_offset(header.num_bucket_target_ranks));
+  auto histogram_bins = (const int64_t *)(records + header.num_records);
+  KmerHistogram histogram;
+  for (uint32_t i = 0; i < header.num_histogram_bins; i++) histogram.add(i, histogram_bins[i]);
+  histogram.add_num_dropped(header.num_dropped);
+  local_kmers->reserve(header.num_records);
+  int64_t num_purged = 0;
+  for (uint64_t i = 0; i < header.num_records; i++) {
+    auto &record = records[i];
+    // the extensions are chosen as when counting, with the min depth threshold of this run
+    char left_ext = choose_ext(record.left_ext_counts, record.count);
+    char right_ext = choose_ext(record.right_ext_counts, record.count);
+    if (left_ext == 'X' && right_ext == 'X') {
+      num_purged++;
+      continue;
+    }
+    local_kmers->insert({record.kmer, {.frag_idx = 0, .count = record.count, .exts = KmerCounts::pack_exts(left_ext, right_ext)}});
+  }
+  munmap((void *)buf, file_stat.st_size);
+  close(fd);
+  // the later rounds are sized from the histogram, just as if the kmers had been counted
+  add_kmer_histogram(histogram);
+  auto all_num_records = reduce_one(header.num_records, op_fast_add, 0).wait();
+  auto all_num_purged = reduce_one(num_purged, op_fast_add, 0).wait();
+  SLOG_VERBOSE("Loaded ", get_num_kmers(), " kmers from binary tables instead of counting them, purging ",
+               perc_str(all_num_purged, all_num_records), " with a min depth threshold of ", _dmin_thres, "\n");
+  return true;
+}
+
 template <int MAX_K>
 typename KmerMap<MAX_K>::iterator KmerDHT<MAX_K>::local_kmers_begin() {
   return local_kmers->begin();
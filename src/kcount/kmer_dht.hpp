@@ -42,29 +42,249 @@
  form.
 */
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <iterator>
+#include <memory>
 #include <upcxx/upcxx.hpp>
 
 #include "utils.hpp"
 #include "kmer.hpp"
+#include "upcxx_utils/fixed_size_cache.hpp"
 #include "upcxx_utils/flat_aggr_store.hpp"
 #include "upcxx_utils/three_tier_aggr_store.hpp"
+#include "upcxx_utils/thread_pool.hpp"
 
 using kmer_count_t = uint16_t;
 
 // global variables to avoid passing dist objs to rpcs
 inline int _dmin_thres = 2.0;
 
+// Chooses an extension from the counts of A, C, G and T and the count of the kmer: X if none reach the min depth, or F for a fork
+// if the runner up reaches it too. The kmer counting and the loading of the binary kmer tables both choose them this way.
+template <typename T>
+inline char choose_ext(const T *ext_counts, kmer_count_t count) {
+  // argmax with selects instead of a sort; ties for the top leave the runner up equal to it, so the order doesn't matter
+  int top = 0;
+  int top_count = ext_counts[0];
+  int runner_up_count = 0;
+  for (int i = 1; i < 4; i++) {
+    int ext_count = ext_counts[i];
+    bool is_top = ext_count > top_count;
+    runner_up_count = is_top ? top_count : std::max(runner_up_count, ext_count);
+    top = is_top ? i : top;
+    top_count = is_top ? ext_count : top_count;
+  }
+  // set dynamic_min_depth to 1.0 for single depth data (non-metagenomes)
+  int dmin_dyn = std::max((int)((1.0 - DYN_MIN_DEPTH) * count), _dmin_thres);
+  return "ACGTFX"[top_count < dmin_dyn ? 5 : (runner_up_count >= dmin_dyn ? 4 : top)];
+}
+
 struct FragElem;
+class PackedReads;
+
+// A HyperLogLog sketch of the number of distinct kmers seen, built from kmer hashes. The sketches from all ranks are merged by
+// taking the max of each register.
+class HyperLogLog {
+  // 2^14 registers gives a standard error of about 0.8%
+  static const int INDEX_BITS = 14;
+  vector<uint8_t> registers;
+
+ public:
+  HyperLogLog();
+
+  void add(uint64_t hash) {
+    auto &reg = registers[hash >> (64 - INDEX_BITS)];
+    // the position of the first set bit in the remaining bits, with a sentinel so an all zero hash doesn't overflow
+    uint8_t rank = __builtin_clzll((hash << INDEX_BITS) | (1ULL << (INDEX_BITS - 1))) + 1;
+    if (rank > reg) reg = rank;
+  }
+
+  void merge_all();
+
+  double estimate() const;
+};
+
+// The number of distinct kmers with each count in a round's kmer table, with all the counts from MAX_COUNT up in the last bin.
+// It is built while the kmers are copied into the final hash table, which looks at every kmer anyway, and summed over all the
+// ranks by merge_all.
+class KmerHistogram {
+  static const int MAX_COUNT = 10000;
+  vector<int64_t> num_kmers;
+  // the kmers dropped for lack of memory, whose counts are unknown
+  int64_t num_dropped = 0;
+
+ public:
+  KmerHistogram();
+
+  void add(int count, int64_t num = 1) { num_kmers[std::min(count, MAX_COUNT)] += num; }
+
+  int get_num_bins() const { return num_kmers.size(); }
+
+  int64_t get_num_kmers(int count) const { return num_kmers[count]; }
+
+  void add_num_dropped(int64_t num) { num_dropped += num; }
+
+  int64_t get_num_dropped() const { return num_dropped; }
 
-// total bytes: 8+2+2=12
+  void merge_all();
+
+  int64_t get_num_distinct() const;
+
+  int64_t get_num_singletons() const { return num_kmers[1]; }
+
+  // the kmers that can be kept in the final table, i.e. not purged for a count below 2
+  int64_t get_num_solid() const { return get_num_distinct() - num_kmers[0] - num_kmers[1]; }
+
+  void write(const string &fname) const;
+};
+
+// The sizes of the kmer tables of the earlier rounds, from their histograms, for sizing the table of the next round. The solid
+// kmers follow the trend of the earlier rounds, and the singletons, which mostly come from errors, grow in proportion to k,
+// since each error is in up to k kmers.
+struct KmerTableSizes {
+  vector<int> kmer_lens;
+  vector<int64_t> num_distinct;
+  vector<int64_t> num_singletons;
+  vector<int64_t> num_dropped;
+
+  void add(int kmer_len, const KmerHistogram &histogram);
+
+  // returns false if there are no earlier rounds to predict from
+  bool predict(int kmer_len, int64_t &predicted_num_distinct, double &predicted_singleton_fraction) const;
+
+  // if the last round dropped kmers, its histogram undercounts the distinct kmers, and so does the prediction
+  bool last_round_dropped_kmers() const { return !num_dropped.empty() && num_dropped.back(); }
+
+  void clear();
+};
+
+// global so that it lasts across the rounds, which each use a different template instance
+inline KmerTableSizes _kmer_table_sizes;
+
+// A counted kmer as written to the binary kmer tables, before its extensions are chosen. It keeps the counts of each extension so
+// that a run loading the table chooses the extensions with its own min depth threshold.
+template <int MAX_K>
+struct KmerTableRecord {
+  Kmer<MAX_K> kmer;
+  kmer_count_t count;
+  uint16_t left_ext_counts[4];
+  uint16_t right_ext_counts[4];
+};
+
+// A count-min sketch of kmer abundances, built from kmer hashes. Each row is indexed by a different combination of the two
+// halves of the hash, and the estimate is the least count over the rows, so it can only overcount. The sketches from all ranks
+// are summed by merge_all, to give the abundances over all the reads.
+class CountMinSketch {
+  static const int NUM_ROWS = 4;
+  int64_t row_width;
+  vector<uint32_t> counts;
+
+  int64_t get_index(uint64_t hash, int row) const {
+    uint64_t h1 = hash & 0xffffffff;
+    uint64_t h2 = (hash >> 32) | 1;
+    return row * row_width + (h1 + row * h2) % row_width;
+  }
+
+ public:
+  CountMinSketch(int64_t num_bytes);
+
+  void add(uint64_t hash) {
+    for (int row = 0; row < NUM_ROWS; row++) {
+      auto &count = counts[get_index(hash, row)];
+      if (count < UINT32_MAX) count++;
+    }
+  }
+
+  uint32_t estimate(uint64_t hash) const {
+    uint32_t min_count = UINT32_MAX;
+    for (int row = 0; row < NUM_ROWS; row++) min_count = std::min(min_count, counts[get_index(hash, row)]);
+    return min_count;
+  }
+
+  void merge_all();
+};
+
+// The reads kept by digital normalization, for each library in the packed reads list, so that the size estimates and every
+// round of kmer counting skip the same reads. Empty when all the reads are used.
+struct DiginormReads {
+  vector<vector<bool>> kept;
+
+  bool empty() const { return kept.empty(); }
+
+  bool is_kept(int lib_i, int64_t read_i) const { return kept.empty() || kept[lib_i][read_i]; }
+
+  void clear() { vector<vector<bool>>().swap(kept); }
+};
+
+// global so that it lasts across the rounds, which each count kmers with a different template instance
+inline DiginormReads _diginorm_reads;
+
+// Large untyped buffers that are kept for the whole run, so that the kmer tables of each round reuse the memory of the previous
+// round instead of freeing it and then faulting in fresh pages, even when the rounds have different kmer widths. A buffer is
+// only reallocated when a round needs it to be bigger, and can only be acquired by one table at a time.
+class TableMemPool {
+ public:
+  enum BufferId { KMER_KEYS, KMER_COUNTS, NUM_BUFFERS };
+
+ private:
+  struct Buffer {
+    std::unique_ptr<uint8_t[]> data;
+    size_t bytes = 0;
+    bool in_use = false;
+  };
+  Buffer buffers[NUM_BUFFERS];
+
+ public:
+  // the contents are left as they were
+  void *acquire(BufferId id, size_t bytes);
+
+  void release(BufferId id);
+
+  // frees all the buffers, which must not be in use
+  void clear();
+
+  size_t get_bytes() const;
+};
+
+// global so that it lasts across the rounds, which each count kmers with a different template instance
+inline TableMemPool _table_mem_pool;
+
+// total bytes: 4+2+1=7 (8 with alignment)
 struct KmerCounts {
-  global_ptr<FragElem> uutig_frag;
+  // index into the owning rank's table of fragments that have visited this kmer, offset by 1 so that 0 means unvisited
+  uint32_t frag_idx;
   // how many times this kmer has occurred: don't need to count beyond 65536
   kmer_count_t count;
-  // the final extensions chosen - A,C,G,T, or F,X
-  char left, right;
+  // the final extensions chosen - A,C,G,T, or F,X - packed into the high (left) and low (right) nibbles
+  uint8_t exts;
+
+  static uint8_t ext_to_code(char ext) {
+    switch (ext) {
+      case 'A': return 0;
+      case 'C': return 1;
+      case 'G': return 2;
+      case 'T': return 3;
+      case 'F': return 4;
+      default: return 5;
+    }
+  }
+
+  static uint8_t pack_exts(char left, char right) { return (ext_to_code(left) << 4) | ext_to_code(right); }
+
+  char get_left_ext() const { return "ACGTFX"[exts >> 4]; }
+
+  char get_right_ext() const { return "ACGTFX"[exts & 15]; }
+};
+
+// The result of looking up one kmer in a batch, oriented as the kmer was given rather than in its canonical form.
+struct KmerLookup {
+  bool found;
+  kmer_count_t count;
+  // A, C, G, T, or F for a fork or X for no extension
+  char left_ext;
+  char right_ext;
 };
 
 template <int MAX_K>
@@ -75,23 +295,165 @@ struct KmerAndExt {
   UPCXX_SERIALIZED_FIELDS(kmer, count, left, right);
 };
 
+// A view of a packed supermer, pointing into the packed bytes.
+struct PackedSupermerView {
+  int len;
+  // 2 bits per base, 4 bases per byte, with the first base in the high bits
+  const uint8_t *bases;
+  // one bit per base, set for good quality; null if all the bases are good quality
+  const uint8_t *quals;
+
+  int get_code(int i) const { return (bases[i / 4] >> (2 * (3 - i % 4))) & 3; }
+
+  char get_base(int i) const { return "ACGT"[get_code(i)]; }
+
+  bool is_good_qual(int i) const { return !quals || ((quals[i / 8] >> (i % 8)) & 1); }
+
+  static PackedSupermerView unpack(const uint8_t *buf, int num_bytes);
+};
+
 struct Supermer {
-  // qualities must be represented, but only as good or bad, so this is done with lowercase for bad, uppercase otherwise
+  // qualities must be represented, but only as good or bad. When packed on the CPU, the seq is a varint header of
+  // (length << 1 | has_bad_quals), followed by the bases at 2 bits each, followed by the quality bitmask only if there are any
+  // bad quality bases (N counts as bad). The GPU sends its own 4 bit packing, which is decoded on the GPU.
   string seq;
   kmer_count_t count;
 
-  UPCXX_SERIALIZED_FIELDS(seq, count);
+  // lowercase bases in the unpacked seq are bad quality
+  void pack(string_view unpacked_seq);
+
+  // repacks a range of bases that are already packed, without going through the unpacked form
+  void pack(const PackedSupermerView &packed_seq, int start, int len);
+};
 
-  void pack(const string &unpacked_seq);
+// A supermer packed inline in a fixed size, for handling on the receiving rank. Supermers longer than MAX_BASES are split into
+// chunks that overlap by k + 1 bases. On the wire and in the spill files, a chunk is a variable length record of the count, the
+// number of bytes and only the bytes of the seq that are used, so that short supermers are not padded to the longest.
+template <int MAX_K>
+struct SupermerChunk {
+  // room for any kmer with both its extensions
+  static constexpr int MAX_BASES = 2 * MAX_K;
+  // the larger of the CPU packing (a varint header and 3 bits per base) and the unaligned 4 bit GPU packing
+  static constexpr int MAX_BYTES = MAX_K + 1;
+  static_assert(MAX_BYTES < 256, "the supermer chunk length must fit in a byte");
+  static constexpr int RECORD_HEADER_BYTES = sizeof(kmer_count_t) + 1;
+  static constexpr int MAX_RECORD_BYTES = RECORD_HEADER_BYTES + MAX_BYTES;
 
-  void unpack();
+  kmer_count_t count;
+  uint8_t len;
+  uint8_t seq[MAX_BYTES];
+
+  void set(const Supermer &supermer) {
+    if (supermer.seq.length() > MAX_BYTES)
+      DIE("Packed supermer of ", supermer.seq.length(), " bytes is too long for a chunk of ", MAX_BYTES, " bytes");
+    count = supermer.count;
+    len = supermer.seq.length();
+    memcpy(seq, supermer.seq.data(), len);
+  }
+
+  PackedSupermerView get_packed_view() const { return PackedSupermerView::unpack(seq, len); }
+
+  string get_seq() const { return string((const char *)seq, len); }
+
+  static int get_record_bytes(int seq_bytes) { return RECORD_HEADER_BYTES + seq_bytes; }
+
+  // the length of the record at buf, from its header
+  static int peek_record_bytes(const uint8_t *buf) { return get_record_bytes(buf[sizeof(kmer_count_t)]); }
+
+  // returns the number of bytes written
+  static int write_record(uint8_t *buf, kmer_count_t count, const void *seq, int seq_bytes) {
+    memcpy(buf, &count, sizeof(count));
+    buf[sizeof(count)] = seq_bytes;
+    memcpy(buf + RECORD_HEADER_BYTES, seq, seq_bytes);
+    return get_record_bytes(seq_bytes);
+  }
+
+  int write_record(uint8_t *buf) const { return write_record(buf, count, seq, len); }
+
+  // returns the number of bytes read
+  int read_record(const uint8_t *buf) {
+    memcpy(&count, buf, sizeof(count));
+    len = buf[sizeof(count)];
+    memcpy(seq, buf + RECORD_HEADER_BYTES, len);
+    return get_record_bytes(len);
+  }
+};
 
-  int get_bytes();
+// The supermer records sent to one target, gathered into a block of a fixed size so that it is trivially copyable and the kmer
+// store can aggregate it through node shared memory in three tier mode. Only the unused tail of each block is sent as padding.
+template <int MAX_K>
+struct SupermerBlock {
+  // room for a few of the longest supermers, and many more of the typical ones
+  static constexpr int MAX_BYTES = 4 * SupermerChunk<MAX_K>::MAX_RECORD_BYTES;
+
+  uint16_t num_bytes;
+  uint16_t num_supermers;
+  uint8_t bytes[MAX_BYTES];
+
+  void clear() {
+    num_bytes = 0;
+    num_supermers = 0;
+  }
+
+  // returns false if there is no room left for the supermer, which always fits into an empty block
+  bool add(const Supermer &supermer) {
+    if (supermer.seq.length() > SupermerChunk<MAX_K>::MAX_BYTES)
+      DIE("Packed supermer of ", supermer.seq.length(), " bytes is too long for a chunk of ", SupermerChunk<MAX_K>::MAX_BYTES,
+          " bytes");
+    if (num_bytes + SupermerChunk<MAX_K>::get_record_bytes(supermer.seq.length()) > MAX_BYTES) return false;
+    num_bytes += SupermerChunk<MAX_K>::write_record(bytes + num_bytes, supermer.count, supermer.seq.data(), supermer.seq.length());
+    num_supermers++;
+    return true;
+  }
+
+  // decodes every supermer in the block into chunks
+  void get_supermers(vector<SupermerChunk<MAX_K>> &supermers) const {
+    for (int pos = 0; pos < num_bytes;) {
+      supermers.emplace_back();
+      pos += supermers.back().read_record(bytes + pos);
+    }
+  }
 };
 
 template <int MAX_K>
 using KmerMap = HASH_TABLE<Kmer<MAX_K>, KmerCounts>;
 
+// A read-only index over the final kmers, built once per round for the traversal phase. A minimal perfect hash (levels of
+// collision-free bit arrays) maps each kmer to a slot in a dense array of entries, and an 8-bit fingerprint per slot rejects
+// most kmers that are not in the set without touching the entries.
+template <int MAX_K>
+class StaticKmerIndex {
+  using Entries = vector<pair<Kmer<MAX_K>, KmerCounts>>;
+
+  Entries entries;
+  vector<uint8_t> fingerprints;
+  // the bit arrays for all the levels concatenated, with the number of set bits preceding each word
+  vector<uint64_t> level_bits;
+  vector<uint32_t> level_ranks;
+  vector<int64_t> level_word_offsets;
+  // the few kmers that still collide after the last level
+  HASH_TABLE<Kmer<MAX_K>, uint32_t> fallback_slots;
+
+  int64_t get_slot(const Kmer<MAX_K> &kmer, uint64_t kmer_hash) const;
+
+ public:
+  // moves all the elements out of kmers, leaving it empty
+  void build(KmerMap<MAX_K> &kmers);
+
+  void clear();
+
+  KmerCounts *find(const Kmer<MAX_K> &kmer);
+
+  size_t size() const { return entries.size(); }
+
+  // memory used by the index itself, excluding the entries
+  int64_t get_index_bytes() const;
+
+  typename Entries::iterator begin() { return entries.begin(); }
+
+  typename Entries::iterator end() { return entries.end(); }
+};
+
 template <int MAX_K>
 class HashTableInserter {
   struct HashTableInserterState;
@@ -102,15 +464,36 @@ class HashTableInserter {
   HashTableInserter();
   ~HashTableInserter();
 
-  void init(int num_elems, bool use_qf);
+  // the GPU build computes the kmer targets on the device from the greatest minimizer, which can only map minimizer buckets to
+  // ranks
+  static bool supports_host_kmer_targets();
+
+  // with use_node_tables, the tables are put in the shared segment so that the ranks on a node can insert into each other's tables
+  // directly, if there is enough space in the segment on all the ranks (CPU only)
+  // with more than one kmer partition, the supermers are spilled to a file per partition in spill_dir and only counted when they
+  // are inserted into the local hashtable, one partition at a time (CPU only)
+  void init(int num_elems, bool use_qf, bool use_sort_kcount, bool use_node_tables, int num_partitions, const string &spill_dir);
 
   void init_ctg_kmers(int max_elems);
 
-  void insert_supermer(const std::string &supermer_seq, kmer_count_t supermer_count);
+  void insert_supermer(const SupermerChunk<MAX_K> &supermer);
+
+  // inserts all the supermers delivered together, which the CPU table decodes up front to prefetch across the whole batch
+  void insert_supermers(const SupermerChunk<MAX_K> *supermers, size_t num_supermers);
+
+  bool has_node_tables();
+
+  void spill_supermer(const SupermerChunk<MAX_K> &supermer, int partition);
+
+  // inserts the kmers from a read supermer straight into the table of a rank on the same node, which must have node tables
+  void insert_supermer_into_node_table(const SupermerChunk<MAX_K> &supermer, intrank_t target_rank);
 
   void flush_inserts();
 
-  void insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers);
+  // also adds the count of every kmer in the table, including those purged, to the histogram, and passes every kmer that can be
+  // kept, i.e. with a count of at least 2, to dump_record if it is set
+  void insert_into_local_hashtable(dist_object<KmerMap<MAX_K>> &local_kmers, KmerHistogram &histogram,
+                                   const std::function<void(const KmerTableRecord<MAX_K> &)> &dump_record = nullptr);
 
   //void get_elapsed_time(double &insert_time, double &kernel_time);
 };
@@ -119,20 +502,106 @@ template <int MAX_K>
 class KmerDHT {
  private:
   dist_object<KmerMap<MAX_K>> local_kmers;
+  // when built, this holds all the local kmers in place of local_kmers
+  dist_object<StaticKmerIndex<MAX_K>> static_index;
   dist_object<HashTableInserter<MAX_K>> ht_inserter;
-
-  upcxx_utils::ThreeTierAggrStore<Supermer> kmer_store;
+  // the fragments that have visited kmers on this rank, so each kmer only needs to store a 32-bit index
+  vector<global_ptr<FragElem>> visited_frags;
+  HASH_TABLE<global_ptr<FragElem>, uint32_t> visited_frag_idxs;
+
+  upcxx_utils::ThreeTierAggrStore<SupermerBlock<MAX_K>> kmer_store;
+  // the block being filled for each target rank
+  vector<SupermerBlock<MAX_K>> send_blocks;
+  int64_t num_blocks_sent = 0;
+  int64_t num_block_bytes_used = 0;
+
+  void send_block(int target_rank);
+  // combines identical supermers from reads before they are sent, keyed on the sequence (which determines the target rank)
+  struct CombinedSupermer {
+    kmer_count_t count;
+    int target_rank;
+  };
+  upcxx_utils::FixedSizeCache<string, CombinedSupermer> supermer_cache;
+  int64_t num_supermers_added = 0;
+  int64_t num_supermers_combined = 0;
   int64_t max_kmer_store_bytes;
   int64_t my_num_kmers;
   int max_rpcs_in_flight;
   //std::chrono::time_point<std::chrono::high_resolution_clock> start_t;
 
   int minimizer_len = 15;
+  // When balancing, the minimizer hashes are split into more buckets than ranks, and the buckets found to be heavy in a sample
+  // of the reads are reassigned to the least loaded ranks. Empty if each rank is a bucket, i.e. the hash modulo the ranks.
+  vector<upcxx::intrank_t> bucket_target_ranks;
+  // When set, kmers are sent to a node chosen from a shorter minimizer, which changes less often along a sequence, and then to
+  // a rank within that node chosen from the full minimizer.
+  bool node_first_targets = false;
+  int num_target_nodes = 0;
+  int num_target_threads = 0;
+  // When more than one, the kmers received by each rank are split by their minimizers into this many partitions, which are
+  // spilled to disk and counted one at a time, so the counting table only has to hold one partition.
+  int num_kmer_partitions = 1;
+  vector<Kmer<MAX_K>> partition_kmers_buf;
+
+  upcxx::intrank_t get_minimizer_target_rank(const Kmer<MAX_K> &kmer, uint64_t minimizer_hash, const Kmer<MAX_K> *kmer_rc) const;
+
+  int get_supermer_partition(const SupermerChunk<MAX_K> &supermer);
+
+  // When set, the supermers received are collected into larger batches that are inserted on a dedicated thread, so that the
+  // inserts overlap with the extraction and sending on the master thread, instead of running in the rpcs.
+  std::unique_ptr<upcxx_utils::ThreadPool> insert_thread;
+  // in supermer blocks
+  static const int INSERT_BATCH_SIZE = 512;
+  static const int MAX_PENDING_INSERT_BATCHES = 16;
+  vector<SupermerBlock<MAX_K>> insert_batch;
+  upcxx::future<> insert_batches_fut = upcxx::make_future();
+  std::atomic<int> num_pending_insert_batches{0};
+  int64_t num_insert_batch_waits = 0;
+
+  // the supermers decoded from the received blocks, only used by whichever thread does the inserts
+  vector<SupermerChunk<MAX_K>> received_supermers;
+
+  void insert_received_supermers(const SupermerBlock<MAX_K> *blocks, size_t num_blocks);
+
+  void enqueue_insert_batch();
+
+  // waits until the insert thread has room for more batches, which can only be called outside of the rpcs
+  void wait_for_insert_slots();
+
+  void wait_for_insert_thread();
+
+  void balance_minimizer_buckets(const vector<int64_t> &bucket_counts);
+
+  // estimate the number of distinct kmers that will be sent to this rank from a sample of the reads, balancing the minimizer
+  // buckets first if requested
+  int64_t estimate_num_kmers(vector<PackedReads *> &packed_reads_list, bool balance_kmer_targets);
+
+  // true if the whole table was loaded from binary dumps, so there is nothing to count
+  bool kmers_loaded = false;
+
+  // returns false, on all ranks, unless every rank has a valid dump for this k
+  bool load_kmers_binary();
+
+  // copies the counted kmers into the final table while writing them to the binary kmer table of this rank
+  void insert_into_local_hashtable_and_dump(KmerHistogram &histogram);
+
+  // merges the histogram of the round over all the ranks and adds it to the table sizes used to size the later rounds
+  void add_kmer_histogram(KmerHistogram &histogram);
 
  public:
   bool using_ctg_kmers = false;
 
-  KmerDHT(uint64_t my_num_kmers, int max_kmer_store_bytes, int max_rpcs_in_flight, bool useHHSS, bool use_qf);
+  // when load_kmers is set, the table is loaded from the binary dumps for this k if they exist, instead of being counted
+  // the kmer partitions are spilled to kmer_spill_dir, or to the per rank directories if it is empty
+  KmerDHT(vector<PackedReads *> &packed_reads_list, int max_kmer_store_bytes, int max_rpcs_in_flight, bool useHHSS, bool use_qf,
+          bool use_sort_kcount, int supermer_cache_size, bool balance_kmer_targets, bool node_first_targets, bool load_kmers,
+          bool use_node_tables, int num_kmer_partitions, const string &kmer_spill_dir, bool use_insert_thread);
+
+  bool get_kmers_loaded() const { return kmers_loaded; }
+
+  // For every minimizer scheme, reports the supermers per read, their average length, the bytes they would take and the load
+  // balance over the ranks for a sample of the reads, with the kmers sent to the minimizer hash modulo the ranks.
+  void report_minimizer_schemes(vector<PackedReads *> &packed_reads_list);
 
   void clear_stores();
 
@@ -148,15 +617,59 @@ class KmerDHT {
 
   upcxx::intrank_t get_kmer_target_rank(const Kmer<MAX_K> &kmer, const Kmer<MAX_K> *kmer_rc = nullptr) const;
 
+  // the target rank times the number of kmer partitions plus the partition of the kmer on that rank, from a single minimizer
+  int64_t get_kmer_target(const Kmer<MAX_K> &kmer, const Kmer<MAX_K> *kmer_rc = nullptr) const;
+
+  int get_num_kmer_partitions() const { return num_kmer_partitions; }
+
+  bool uses_node_first_targets() const { return node_first_targets; }
+
+  // the target rank the kmer would have without node first targets, for comparing the supermers that each routing gives
+  upcxx::intrank_t get_flat_kmer_target_rank(const Kmer<MAX_K> &kmer) const {
+    return kmer.minimizer_hash_fast(minimizer_len) % upcxx::rank_n();
+  }
+
+  // for computing targets elsewhere (e.g. on the GPU): the bucket is the minimizer hash modulo the number of buckets
+  int get_num_minimizer_buckets() const;
+
+  upcxx::intrank_t get_bucket_target_rank(int bucket) const;
+
   KmerCounts *get_local_kmer_counts(Kmer<MAX_K> &kmer);
 
   bool kmer_exists(Kmer<MAX_K> kmer);
 
+  // Looks up a batch of kmers with a single rpc to each target rank, instead of a round trip for every kmer. The results are
+  // in the same order as the kmers.
+  upcxx::future<vector<KmerLookup>> lookup_kmers(const vector<Kmer<MAX_K>> &kmers);
+
+  // get the rank-local index used to mark kmers as visited by this fragment, adding it if this is the first visit
+  uint32_t get_frag_idx(global_ptr<FragElem> frag_elem_gptr);
+
+  // get the rank-local index of this fragment, or 0 if it hasn't visited any kmers on this rank yet
+  uint32_t find_frag_idx(global_ptr<FragElem> frag_elem_gptr) const;
+
+  global_ptr<FragElem> get_frag_gptr(uint32_t frag_idx);
+
   void add_supermer(Supermer &supermer, int target_rank);
 
+  void send_supermer(const Supermer &supermer, int target_rank);
+
+  void flush_supermer_cache();
+
   void flush_updates();
 
-  void finish_updates();
+  // when dump_tables is set, the kmers are also written to the binary kmer tables, one file per rank
+  void finish_updates(bool dump_tables = false);
+
+  // replace the local hash table with a read-only minimal perfect hash index for the traversal phase
+  void build_static_index();
+
+  // visit every local kmer, whether it is held in the hash table or the static index
+  template <typename F>
+  void for_each_local_kmer(F &&func) {
+    for (auto &elem : *local_kmers) func(elem.first, elem.second);
+    for (auto &elem : *static_index) func(elem.first, elem.second);
+  }
 
   // one line per kmer, format:
   // KMERCHARS LR N
@@ -0,0 +1,203 @@
+/*
+ HipMer v 2.0, Copyright (c) 2020, The Regents of the University of California,
+ through Lawrence Berkeley National Laboratory (subject to receipt of any required
+ approvals from the U.S. Dept. of Energy).  All rights reserved."
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+ (1) Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ (2) Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ (3) Neither the name of the University of California, Lawrence Berkeley National
+ Laboratory, U.S. Dept. of Energy nor the names of its contributors may be used to
+ endorse or promote products derived from this software without specific prior
+ written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ DAMAGE.
+
+ You are under no obligation whatsoever to provide any bug fixes, patches, or upgrades
+ to the features, functionality or performance of the source code ("Enhancements") to
+ anyone; however, if you choose to make your Enhancements available either publicly,
+ or directly to Lawrence Berkeley National Laboratory, without imposing a separate
+ written license agreement for such Enhancements, then you hereby grant the following
+ license: a  non-exclusive, royalty-free perpetual license to install, use, modify,
+ prepare derivative works, incorporate into other computer software, distribute, and
+ sublicense such enhancements or derivative works thereof, in binary and source code
+ form.
+*/
+
+#include <algorithm>
+#include <limits>
+
+#include "upcxx_utils/log.hpp"
+
+#include "kmer_dht.hpp"
+
+using namespace std;
+using namespace upcxx;
+using namespace upcxx_utils;
+
+// each level has this many bits per remaining kmer: higher means fewer levels (faster lookups) but more memory
+static const double LEVEL_GAMMA = 2.0;
+// after this many levels any remaining kmers go into the fallback hash table
+static const int MAX_LEVELS = 32;
+
+static inline uint64_t mix_hash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t get_level_pos(uint64_t kmer_hash, int level, uint64_t num_bits) {
+  uint64_t h = mix_hash(kmer_hash + (level + 1) * 0x9e3779b97f4a7c15ULL);
+  // map onto [0, num_bits) without a division
+  return ((unsigned __int128)h * num_bits) >> 64;
+}
+
+static inline uint8_t get_fingerprint(uint64_t kmer_hash) { return kmer_hash >> 56; }
+
+template <int MAX_K>
+void StaticKmerIndex<MAX_K>::build(KmerMap<MAX_K> &kmers) {
+  clear();
+  if (kmers.size() >= numeric_limits<uint32_t>::max()) DIE("Too many kmers for static index: ", kmers.size());
+  // the entries are moved out of the map, which is released straight away, and then permuted in place into their slots, so
+  // there are never more than two copies of the kmers at once
+  entries.reserve(kmers.size());
+  for (auto &elem : kmers) entries.emplace_back(elem.first, std::move(elem.second));
+  KmerMap<MAX_K>().swap(kmers);
+  int64_t num_kmers = entries.size();
+  vector<uint64_t> hashes(num_kmers);
+  for (int64_t i = 0; i < num_kmers; i++) hashes[i] = entries[i].first.hash();
+  vector<uint32_t> remaining(num_kmers);
+  for (int64_t i = 0; i < num_kmers; i++) remaining[i] = i;
+  vector<uint32_t> next_remaining;
+  for (int level = 0; level < MAX_LEVELS && !remaining.empty(); level++) {
+    int64_t num_words = (max((int64_t)(LEVEL_GAMMA * remaining.size()), (int64_t)64) + 63) / 64;
+    uint64_t num_bits = num_words * 64;
+    vector<uint64_t> seen(num_words, 0), collided(num_words, 0);
+    for (auto i : remaining) {
+      auto pos = get_level_pos(hashes[i], level, num_bits);
+      uint64_t mask = 1ULL << (pos % 64);
+      if (seen[pos / 64] & mask)
+        collided[pos / 64] |= mask;
+      else
+        seen[pos / 64] |= mask;
+    }
+    next_remaining.clear();
+    for (auto i : remaining) {
+      auto pos = get_level_pos(hashes[i], level, num_bits);
+      if (collided[pos / 64] & (1ULL << (pos % 64))) next_remaining.push_back(i);
+    }
+    level_word_offsets.push_back(level_bits.size());
+    for (int64_t w = 0; w < num_words; w++) level_bits.push_back(seen[w] & ~collided[w]);
+    remaining.swap(next_remaining);
+  }
+  level_word_offsets.push_back(level_bits.size());
+  level_ranks.resize(level_bits.size());
+  uint32_t num_set = 0;
+  for (size_t w = 0; w < level_bits.size(); w++) {
+    level_ranks[w] = num_set;
+    num_set += __builtin_popcountll(level_bits[w]);
+  }
+  for (auto i : remaining) fallback_slots.insert({entries[i].first, num_set + fallback_slots.size()});
+  vector<uint32_t>().swap(remaining);
+  vector<uint32_t>().swap(next_remaining);
+  // the slot of each entry in the index
+  vector<uint32_t> slots(num_kmers);
+  fingerprints.resize(num_kmers);
+  for (int64_t i = 0; i < num_kmers; i++) {
+    auto slot = get_slot(entries[i].first, hashes[i]);
+    assert(slot >= 0 && slot < num_kmers);
+    slots[i] = slot;
+    fingerprints[slot] = get_fingerprint(hashes[i]);
+  }
+  vector<uint64_t>().swap(hashes);
+  // follow the cycles of the permutation to put every entry into its slot
+  for (int64_t i = 0; i < num_kmers; i++) {
+    while (slots[i] != i) {
+      auto j = slots[i];
+      swap(entries[i], entries[j]);
+      swap(slots[i], slots[j]);
+    }
+  }
+}
+
+template <int MAX_K>
+void StaticKmerIndex<MAX_K>::clear() {
+  Entries().swap(entries);
+  vector<uint8_t>().swap(fingerprints);
+  vector<uint64_t>().swap(level_bits);
+  vector<uint32_t>().swap(level_ranks);
+  vector<int64_t>().swap(level_word_offsets);
+  HASH_TABLE<Kmer<MAX_K>, uint32_t>().swap(fallback_slots);
+}
+
+template <int MAX_K>
+int64_t StaticKmerIndex<MAX_K>::get_slot(const Kmer<MAX_K> &kmer, uint64_t kmer_hash) const {
+  int num_levels = (int)level_word_offsets.size() - 1;
+  for (int level = 0; level < num_levels; level++) {
+    int64_t start_word = level_word_offsets[level];
+    uint64_t num_bits = (level_word_offsets[level + 1] - start_word) * 64;
+    auto pos = get_level_pos(kmer_hash, level, num_bits);
+    int64_t word = start_word + pos / 64;
+    uint64_t bits = level_bits[word];
+    uint64_t mask = 1ULL << (pos % 64);
+    if (bits & mask) return level_ranks[word] + __builtin_popcountll(bits & (mask - 1));
+  }
+  if (fallback_slots.empty()) return -1;
+  const auto it = fallback_slots.find(kmer);
+  if (it == fallback_slots.end()) return -1;
+  return it->second;
+}
+
+template <int MAX_K>
+KmerCounts *StaticKmerIndex<MAX_K>::find(const Kmer<MAX_K> &kmer) {
+  uint64_t kmer_hash = kmer.hash();
+  auto slot = get_slot(kmer, kmer_hash);
+  if (slot < 0) return nullptr;
+  // kmers not in the set still map to some slot, and the fingerprint filters out most of them
+  if (fingerprints[slot] != get_fingerprint(kmer_hash)) return nullptr;
+  if (!(entries[slot].first == kmer)) return nullptr;
+  return &entries[slot].second;
+}
+
+template <int MAX_K>
+int64_t StaticKmerIndex<MAX_K>::get_index_bytes() const {
+  return level_bits.size() * sizeof(uint64_t) + level_ranks.size() * sizeof(uint32_t) + fingerprints.size() +
+         fallback_slots.size() * (sizeof(Kmer<MAX_K>) + sizeof(uint32_t));
+}
+
+#define STATIC_KMER_INDEX_K(KMER_LEN) template class StaticKmerIndex<KMER_LEN>
+
+STATIC_KMER_INDEX_K(32);
+#if MAX_BUILD_KMER >= 64
+STATIC_KMER_INDEX_K(64);
+#endif
+#if MAX_BUILD_KMER >= 96
+STATIC_KMER_INDEX_K(96);
+#endif
+#if MAX_BUILD_KMER >= 128
+STATIC_KMER_INDEX_K(128);
+#endif
+#if MAX_BUILD_KMER >= 160
+STATIC_KMER_INDEX_K(160);
+#endif
+
+#undef STATIC_KMER_INDEX_K
@@ -117,13 +117,13 @@ void Kmer<MAX_K>::swap(Kmer<MAX_K> &other) {
 
 template <int MAX_K>
 const Kmer<MAX_K> &Kmer<MAX_K>::get_invalid() {
-  static bool _ = false;
-  static Kmer invalid;
-  if (!_) {
-    invalid.longs.fill(0xFFFFFFFFFFFFFFFF);  // all bits set (i.e. poly T with no zero masking)
-    assert(invalid.longs[0] == H2BE(invalid.longs[0]));
-    _ = true;
-  }
+  // initialized once even when first called from several threads extracting kmers
+  static const Kmer invalid = [] {
+    Kmer kmer;
+    kmer.longs.fill(0xFFFFFFFFFFFFFFFF);  // all bits set (i.e. poly T with no zero masking)
+    assert(kmer.longs[0] == H2BE(kmer.longs[0]));
+    return kmer;
+  }();
   return invalid;
 }
 
@@ -175,7 +175,6 @@ void Kmer<MAX_K>::get_kmers(unsigned kmer_len, const std::string_view &seq, std:
   kmers.resize(seq.size() - Kmer::k + 1, {});
   assert(kmers[0] != Kmer::get_invalid());
   longs_t buf[bufsize];
-  uint8_t *bufPtr = (uint8_t *)buf;
   memset(buf, 0, bufsize * 8);
   const char *s = seq.data();
   int N_counter = 0;
@@ -221,6 +220,28 @@ void Kmer<MAX_K>::get_kmers(unsigned kmer_len, const std::string_view &seq, std:
   }
   // fix to big endian
   for (int l = 0; l < bufsize; l++) buf[l] = H2BE(buf[l]);
+  get_kmers_from_buf(buf, bufsize, kmers);
+}
+
+template <int MAX_K>
+void Kmer<MAX_K>::get_kmers_from_packed(unsigned kmer_len, const uint8_t *packed_seq, int seq_len, std::vector<Kmer> &kmers) {
+  assert(Kmer::k > 0);
+  assert(kmer_len == Kmer::k);
+  kmers.clear();
+  if (seq_len < Kmer::k) return;
+  int bufsize = max((int)N_LONGS, (int)(seq_len + 31) / 32) + N_LONGS;
+  kmers.resize(seq_len - Kmer::k + 1, {});
+  longs_t buf[bufsize];
+  memset(buf, 0, bufsize * 8);
+  // 4 bases per byte, first base in the high bits, is already the big endian layout of the buffer
+  memcpy(buf, packed_seq, (seq_len + 3) / 4);
+  get_kmers_from_buf(buf, bufsize, kmers);
+}
+
+template <int MAX_K>
+void Kmer<MAX_K>::get_kmers_from_buf(longs_t *buf, int bufsize, std::vector<Kmer> &kmers) {
+  uint8_t *bufPtr = (uint8_t *)buf;
+  int lastLong = N_LONGS - 1;
   const longs_t mask = ((int64_t)0x3);
   longs_t endmask = 0;
   if (Kmer::k % 32) {
@@ -453,6 +474,10 @@ uint64_t Kmer<MAX_K>::minimizer_hash(int m) const {
 
 template <int MAX_K>
 uint64_t Kmer<MAX_K>::minimizer_hash_fast(int m, const Kmer<MAX_K> *revcomp) const {
+  if (_minimizer_scheme != MinimizerScheme::GREATEST) {
+    if (revcomp) return get_scheme_minimizer_hash(m, *revcomp);
+    return get_scheme_minimizer_hash(m, this->revcomp());
+  }
   uint64_t minimizer;
   if (revcomp == nullptr) {
     minimizer = get_minimizer_fast(m, true);
@@ -462,6 +487,90 @@ uint64_t Kmer<MAX_K>::minimizer_hash_fast(int m, const Kmer<MAX_K> *revcomp) con
   return quick_hash(minimizer);
 }
 
+template <int MAX_K>
+uint64_t Kmer<MAX_K>::get_mmer(int i, int m) const {
+  int shift = i % 32;
+  int l = i / 32;
+  uint64_t mmer = longs[l];
+  if (shift) {
+    mmer <<= shift * 2;
+    if (l < N_LONGS - 1) mmer |= longs[l + 1] >> (64 - shift * 2);
+  }
+  return mmer & ZERO_MASK[m];
+}
+
+// the s-mer length for syncmers, which are selected with a density of 1 / (m - s + 1) when open and twice that when closed
+static const int SYNCMER_S_OFFSET = 4;
+
+// a different hash for ordering m-mers than for routing them, so the chosen hashes are not all small
+static inline uint64_t order_hash(uint64_t mmer) { return quick_hash(mmer ^ 0x9e3779b97f4a7c15ULL); }
+
+// the position of the least hashed s-mer in an m-mer
+static inline int get_least_smer_pos(uint64_t mmer, int m, int s) {
+  int least_pos = 0;
+  uint64_t least_hash = order_hash(mmer & ZERO_MASK[s]);
+  for (int pos = 1; pos <= m - s; pos++) {
+    uint64_t smer_hash = order_hash((mmer << (2 * pos)) & ZERO_MASK[s]);
+    if (smer_hash < least_hash) {
+      least_hash = smer_hash;
+      least_pos = pos;
+    }
+  }
+  return least_pos;
+}
+
+// the frequent signatures excluded by KMC 2: starting with AAA or ACA, or containing AA anywhere after the start
+static inline bool is_frequent_mmer(uint64_t mmer, int m) {
+  uint64_t prefix = mmer >> 58;
+  if (prefix == 0 || prefix == 4) return true;
+  for (int pos = 1; pos < m - 1; pos++) {
+    if (!((mmer << (2 * pos)) >> 60)) return true;
+  }
+  return false;
+}
+
+template <int MAX_K>
+uint64_t Kmer<MAX_K>::get_scheme_minimizer_hash(int m, const Kmer<MAX_K> &revcomp) const {
+  assert(m <= Kmer::k);
+  assert(m <= 28);
+  int s = std::max(m - SYNCMER_S_OFFSET, 1);
+  // the best canonical m-mer selected by the scheme, and the fallback from the random order if none is selected
+  bool found = false;
+  uint64_t best_mmer = 0, best_order = UINT64_MAX;
+  uint64_t fallback_mmer = 0, fallback_order = UINT64_MAX;
+  for (int i = 0; i <= (int)Kmer::k - m; i++) {
+    uint64_t fwd_mmer = get_mmer(i, m);
+    uint64_t rc_mmer = revcomp.get_mmer(Kmer::k - m - i, m);
+    uint64_t mmer = fwd_mmer < rc_mmer ? fwd_mmer : rc_mmer;
+    bool selected = true;
+    uint64_t order;
+    switch (_minimizer_scheme) {
+      case MinimizerScheme::OPEN_SYNCMER:
+      case MinimizerScheme::CLOSED_SYNCMER: {
+        int least_pos = get_least_smer_pos(mmer, m, s);
+        selected = (least_pos == 0 || (_minimizer_scheme == MinimizerScheme::CLOSED_SYNCMER && least_pos == m - s));
+        order = order_hash(mmer);
+        break;
+      }
+      case MinimizerScheme::LEXICOGRAPHIC:
+        selected = !is_frequent_mmer(mmer, m);
+        order = mmer;
+        break;
+      default: order = order_hash(mmer);
+    }
+    if (selected && (!found || order < best_order)) {
+      found = true;
+      best_order = order;
+      best_mmer = mmer;
+    }
+    if (i == 0 || order < fallback_order) {
+      fallback_order = order;
+      fallback_mmer = mmer;
+    }
+  }
+  return quick_hash(found ? best_mmer : fallback_mmer);
+}
+
 template <int MAX_K>
 uint64_t Kmer<MAX_K>::hash() const {
   return MurmurHash3_x64_64(reinterpret_cast<const void *>(longs.data()), N_LONGS * sizeof(longs_t));
@@ -58,12 +58,50 @@
  *  */
 using longs_t = uint64_t;
 
+// How the m-mer that decides where a kmer is sent is chosen from all the canonical m-mers of the kmer. Longer runs of kmers
+// that share it make longer supermers.
+enum class MinimizerScheme {
+  // the greatest m-mer, which avoids the poly-A m-mers that are common errors in Illumina reads
+  GREATEST,
+  // the m-mer with the least hash, i.e. a random order
+  RANDOM,
+  // the m-mers whose least hashed s-mer is at the start (open) or at either end (closed), else the random order
+  OPEN_SYNCMER,
+  CLOSED_SYNCMER,
+  // the least m-mer, skipping the frequent ones that start with AAA or ACA or contain AA after the start
+  LEXICOGRAPHIC
+};
+
+inline const std::vector<std::string> MINIMIZER_SCHEME_NAMES = {"greatest", "random", "open-syncmer", "closed-syncmer",
+                                                                "lexicographic"};
+
+inline MinimizerScheme minimizer_scheme_from_string(const std::string &name) {
+  for (size_t i = 0; i < MINIMIZER_SCHEME_NAMES.size(); i++) {
+    if (MINIMIZER_SCHEME_NAMES[i] == name) return (MinimizerScheme)i;
+  }
+  throw std::runtime_error("Unknown minimizer scheme " + name);
+}
+
+inline std::string minimizer_scheme_to_string(MinimizerScheme scheme) { return MINIMIZER_SCHEME_NAMES[(int)scheme]; }
+
+// global because it applies to every kmer length, and must be the same on all ranks
+inline MinimizerScheme _minimizer_scheme = MinimizerScheme::GREATEST;
+
 template <int MAX_K>
 class Kmer {
   inline static unsigned int k = 0;
   inline static const int N_LONGS = (MAX_K + 31) / 32;
   std::array<longs_t, N_LONGS> longs;
 
+  // extract all the kmers from a buffer of big endian 2-bit bases; kmers must already be sized
+  static void get_kmers_from_buf(longs_t *buf, int bufsize, std::vector<Kmer> &kmers);
+
+  // the m-mer starting at base i, in the high bits
+  uint64_t get_mmer(int i, int m) const;
+
+  // the hash of the minimizer chosen by any scheme other than the greatest m-mer
+  uint64_t get_scheme_minimizer_hash(int m, const Kmer &revcomp) const;
+
  public:
   // serialization has to be public
   UPCXX_SERIALIZED_FIELDS(longs);
@@ -94,6 +132,9 @@ class Kmer {
 
   static void get_kmers(unsigned kmer_len, const std::string_view &seq, std::vector<Kmer> &kmers, bool check_n = false);
 
+  // the sequence is packed 2 bits per base, 4 bases per byte, with the first base in the high bits
+  static void get_kmers_from_packed(unsigned kmer_len, const uint8_t *packed_seq, int seq_len, std::vector<Kmer> &kmers);
+
   Kmer &operator=(const Kmer &o);
 
   bool operator<(const Kmer &o) const;
@@ -126,6 +167,7 @@ class Kmer {
 
   uint64_t minimizer_hash(int m) const;
 
+  // uses the minimizer scheme that is set globally
   uint64_t minimizer_hash_fast(int m, const Kmer *revcomp = nullptr) const;
 
   uint64_t hash() const;
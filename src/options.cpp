@@ -54,6 +54,7 @@
 #include <upcxx/upcxx.hpp>
 
 #include "CLI11.hpp"
+#include "kmer.hpp"
 #include "upcxx_utils/log.hpp"
 #include "upcxx_utils/mem_profile.hpp"
 #include "utils.hpp"
@@ -276,6 +277,14 @@ bool Options::load(int argc, char **argv) {
  
   app.add_flag("--write-gfa", dump_gfa, "Write scaffolding contig graphs in GFA2 format.")->capture_default_str();
   app.add_flag("--dump-kmers", dump_kmers, "Write kmers out after kmer counting.")->capture_default_str();
+  app.add_flag("--dump-kmer-tables", dump_kmer_tables,
+               "Write the kmer table of each round to a binary file per process, for reloading with --load-kmer-tables.")
+      ->capture_default_str();
+  app.add_flag("--load-kmer-tables", load_kmer_tables,
+               "Load the kmer table of each round from the binary files written by --dump-kmer-tables, instead of counting the "
+               "kmers, if they exist and were written with the same number of processes. The kmer extensions are chosen again "
+               "with the --min-depth-thres of this run.")
+      ->capture_default_str();
   
   
   app.add_flag("-v, --verbose", verbose, "Verbose output: lots of detailed information (always available in the log).");
@@ -302,6 +311,77 @@ bool Options::load(int argc, char **argv) {
                "or NUMA domains (cpu, core, numa, none).")
       ->check(CLI::IsMember({"cpu", "core", "numa", "none"}));
   app.add_flag("--use-qf", use_qf, "Use quotient filter to reduce memory at the cost of slower processing.")->capture_default_str();
+  app.add_flag("--use-static-kmer-index", use_static_kmer_index,
+               "Replace the kmer hash table with a minimal perfect hash index for the graph traversal.")
+      ->capture_default_str();
+  app.add_option("--supermer-cache", supermer_cache_size,
+                 "Number of entries in the cache that combines identical supermers before sending (0 to disable).")
+      ->check(CLI::Range(0, 100000000));
+  app.add_flag("--use-sort-kcount", use_sort_kcount,
+               "Count kmers by radix sorting instead of hashing (CPU only): exact, but needs more memory bandwidth.")
+      ->capture_default_str();
+  app.add_flag("--balance-kmer-targets", balance_kmer_targets,
+               "Reassign heavy minimizers to the least loaded processes, based on a sample of the reads.")
+      ->capture_default_str();
+  app.add_flag("--node-first-kmer-targets", node_first_kmer_targets,
+               "Send kmers to a node first and then to a process within it, to keep more traffic within nodes (CPU only).")
+      ->capture_default_str();
+  app.add_flag("--shared-kmer-tables", shared_kmer_tables,
+               "Put the kmer counting tables in the shared segment so that the processes on a node insert kmers into each other's "
+               "tables directly, instead of sending them (CPU only, needs a shared heap large enough for the tables).")
+      ->capture_default_str();
+  app.add_option("--kmer-partitions", kmer_partitions,
+                 "Split the kmers on each process into this many partitions, which are spilled to disk and counted one at a time, "
+                 "so the counting table only has to hold one partition (CPU only).")
+      ->check(CLI::Range(1, 4096))
+      ->capture_default_str();
+  app.add_option("--kmer-spill-dir", kmer_spill_dir,
+                 "Directory, preferably on node local storage, for the kmer partitions (default is the per rank directories).");
+  app.add_flag("--kmer-insert-thread", kmer_insert_thread,
+               "Insert the kmers received by each process on a separate thread, overlapping with the kmer extraction (CPU only).")
+      ->capture_default_str();
+  app.add_flag("--packed-kmer-reads", use_packed_kmer_reads,
+               "Pack the quality masked reads once and count the kmers for every round from them (CPU only): saves the "
+               "unpacking in every round, but keeps about 3/8 of a byte per base in memory across the rounds. The kmers, "
+               "minimizers and supermers are still extracted separately for each round.")
+      ->capture_default_str();
+  app.add_flag("--dedup-kmer-reads", dedup_kmer_reads,
+               "Keep identical reads only once in the packed reads for kmer counting, and count their kmers with the number of "
+               "copies as the depth (implies --packed-kmer-reads, CPU only).")
+      ->capture_default_str();
+  app.add_flag("--dedup-kmer-reads-across-ranks", dedup_kmer_reads_across_ranks,
+               "Deduplicate the reads for kmer counting as with --dedup-kmer-reads, and also combine the identical reads on "
+               "different processes, by sending each distinct read to a process chosen by its hash.")
+      ->capture_default_str();
+  app.add_option("--kmer-extraction-threads", kmer_extraction_threads,
+                 "Extract the kmers of the reads in blocks split across this many tasks in the worker thread pool, which "
+                 "has up to --max-worker-threads threads (0 to extract them on the main thread, CPU only).")
+      ->check(CLI::Range(0, 256))
+      ->capture_default_str();
+  app.add_option("--minimizer-scheme", minimizer_scheme,
+                 "How the minimizer that decides where each kmer is sent is chosen (greatest, random, open-syncmer, "
+                 "closed-syncmer, lexicographic). Only greatest is available on the GPU.")
+      ->check(CLI::IsMember(MINIMIZER_SCHEME_NAMES))
+      ->capture_default_str();
+  app.add_flag("--report-minimizer-schemes", report_minimizer_schemes,
+               "Report the supermers, bytes sent and load balance of every minimizer scheme for a sample of the reads in "
+               "each round.")
+      ->capture_default_str();
+  app.add_option("--diginorm-depth", diginorm_depth,
+                 "Digitally normalize the reads for kmer counting to this depth before the first round, by downsampling the "
+                 "reads whose median kmer abundance is higher (0 to count all the reads).")
+      ->check(CLI::Range(0, 1000000))
+      ->capture_default_str();
+  app.add_option("--diginorm-sketch-mb", diginorm_sketch_mb,
+                 "Memory per process in MB for the count-min sketch of kmer abundances used by --diginorm-depth.")
+      ->check(CLI::Range(1, 100000))
+      ->capture_default_str();
+  app.add_option("--max-traversal-walks", max_traversal_walks,
+                 "Maximum number of de Bruijn graph walks each process keeps in flight, overlapping their remote steps. "
+                 "More than 1 changes the order the kmers are visited in, so the uutigs can come out in a different order "
+                 "and orientation, and the contigs can differ from walking one at a time (1, as before).")
+      ->check(CLI::Range(1, 100000))
+      ->capture_default_str();
   try {
     app.parse(argc, argv);
   } catch (const CLI::ParseError &e) {
@@ -113,7 +113,27 @@ class Options {
   bool restart = false;
   bool shuffle_reads = true;
   bool dump_kmers = false;
+  bool dump_kmer_tables = false;
+  bool load_kmer_tables = false;
   bool use_qf = true;
+  bool use_static_kmer_index = false;
+  bool use_sort_kcount = false;
+  int supermer_cache_size = 0;
+  bool balance_kmer_targets = false;
+  bool node_first_kmer_targets = false;
+  bool shared_kmer_tables = false;
+  int kmer_partitions = 1;
+  string kmer_spill_dir;
+  bool kmer_insert_thread = false;
+  bool use_packed_kmer_reads = false;
+  bool dedup_kmer_reads = false;
+  bool dedup_kmer_reads_across_ranks = false;
+  int kmer_extraction_threads = 0;
+  string minimizer_scheme = "greatest";
+  bool report_minimizer_schemes = false;
+  int diginorm_depth = 0;
+  int diginorm_sketch_mb = 64;
+  int max_traversal_walks = 256;
 
   Options();
   ~Options();
@@ -53,6 +53,14 @@ void test_get_kmers(int klen, string seq) {
     auto sstr = seq.substr(i, klen);
     EXPECT_STREQ(kstr.c_str(), sstr.c_str()) << "kmers eq string " << kstr << " v " << sstr << " at " << i;
   }
+  // the same kmers decoded from the sequence packed at 2 bits per base
+  vector<uint8_t> packed_seq((seq.size() + 3) / 4, 0);
+  for (int i = 0; i < seq.size(); i++) packed_seq[i / 4] |= string("ACGT").find(seq[i]) << (2 * (3 - i % 4));
+  vector<K> packed_vec;
+  K::get_kmers_from_packed(klen, packed_seq.data(), seq.size(), packed_vec);
+  EXPECT_EQ(packed_vec.size(), vec.size()) << "Correct num of kmers from packed seq";
+  for (int i = 0; i < vec.size() && i < packed_vec.size(); i++)
+    EXPECT_TRUE(packed_vec[i] == vec[i]) << "packed kmer " << packed_vec[i].to_string() << " v " << vec[i].to_string() << " at " << i;
 }
 
 template <int MAX_K>
@@ -312,6 +320,26 @@ void test_kmer_minimizers(int kmer_len) {
   }
 }
 
+template <int MAX_K>
+void test_minimizer_schemes(int kmer_len) {
+  int m_len = 15;
+  if (kmer_len < 17) return;
+  string seq("AACTGACCAGACGGGGAGGATGCCATGCTGTTGAATTCTCCCCTTTATTAAGTAAGGAAGTCCGGTGATCCAGAATATTCTGCGGAGTTTTCAAATTTATGTTTTTAATTGATCC"
+             "CCTGACTTGTAAAGGGAATAGTTCCCTAAAATTAC");
+  Kmer<MAX_K>::set_k(kmer_len);
+  vector<Kmer<MAX_K>> kmers;
+  Kmer<MAX_K>::get_kmers(kmer_len, seq, kmers);
+  for (auto &scheme_name : MINIMIZER_SCHEME_NAMES) {
+    _minimizer_scheme = minimizer_scheme_from_string(scheme_name);
+    EXPECT_EQ(minimizer_scheme_to_string(_minimizer_scheme), scheme_name);
+    for (auto &kmer : kmers) {
+      EXPECT_EQ(kmer.minimizer_hash_fast(m_len), kmer.revcomp().minimizer_hash_fast(m_len))
+          << "Minimizer hash for scheme " << scheme_name << " should be the same for fwd and rc kmer " << kmer.to_string();
+    }
+  }
+  _minimizer_scheme = MinimizerScheme::GREATEST;
+}
+
 template <int MAX_K>
 void test_minimizer_performance(int kmer_len, bool fast) {
   int m_len = 15;
@@ -358,11 +386,13 @@ TEST(MHMTest, kmer) {
       test_kmer<32>(i);
       test_get_kmers<32>(i);
       test_kmer_minimizers<32>(i);
+      test_minimizer_schemes<32>(i);
     }
     if (i <= 64) {
       test_kmer<64>(i);
       test_get_kmers<64>(i);
       test_kmer_minimizers<64>(i);
+      test_minimizer_schemes<64>(i);
     }
     /*
     if (i <= 96) {
@@ -0,0 +1,48 @@
+#include "kcount/kmer_dht.hpp"
+#include "gtest/gtest.h"
+
+#include <cctype>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+// lowercase bases and Ns are bad quality, and Ns are packed as G
+static void check_packed_supermer(const PackedSupermerView &packed, const string &seq, int start) {
+  for (int i = 0; i < packed.len; i++) {
+    char base = toupper(seq[start + i]);
+    EXPECT_EQ(packed.get_base(i), base == 'N' ? 'G' : base) << "base at " << start + i << " of " << seq;
+    EXPECT_EQ(packed.is_good_qual(i), isupper(seq[start + i]) && seq[start + i] != 'N') << "qual at " << start + i << " of " << seq;
+  }
+}
+
+static void test_supermer_pack(const string &seq) {
+  Supermer supermer;
+  supermer.pack(seq);
+  auto packed = PackedSupermerView::unpack((const uint8_t *)supermer.seq.data(), supermer.seq.length());
+  EXPECT_EQ(packed.len, seq.length()) << "unpacked length of " << seq;
+  bool all_good = true;
+  for (auto base : seq) {
+    if (!isupper(base) || base == 'N') all_good = false;
+  }
+  EXPECT_EQ(packed.quals == nullptr, all_good) << "quality mask is only packed with bad quality bases in " << seq;
+  check_packed_supermer(packed, seq, 0);
+  // repacking ranges from the packed form, with different alignments of the bases and quality bits
+  for (int start = 0; start < 9 && start < (int)seq.length(); start++) {
+    int len = seq.length() - start - (start % 3);
+    if (len <= 0) continue;
+    Supermer sub_supermer;
+    sub_supermer.pack(packed, start, len);
+    auto sub_packed = PackedSupermerView::unpack((const uint8_t *)sub_supermer.seq.data(), sub_supermer.seq.length());
+    EXPECT_EQ(sub_packed.len, len) << "unpacked length of range at " << start << " of " << seq;
+    check_packed_supermer(sub_packed, seq, start);
+  }
+}
+
+TEST(MHMTest, supermer_pack) {
+  test_supermer_pack("ACGT");
+  test_supermer_pack("acgt");
+  test_supermer_pack("CGCTGTTCCAGATGACGAACCAGGAATTCCGCCAGGTATTCGACTTTATTCGCGAAGTCAAGAAGTTGAACG");
+  test_supermer_pack("CGCTGTtccAGATGACGAACCAGNAATTCCGCCAGGTATTCgACTTTATTCGCGAAGTCAAGAAGTTGAACGtcATCAGTGTGAACTACGGTTGCGAAGGCTTn");
+  test_supermer_pack("nNacGTTGCAtgcaNNNNacgtACGTTTTTgggggCCCCCaaaaaaN");
+}
@@ -165,7 +165,7 @@ class FixedSizeCache {
     auto& bucket = buckets[idx];
     assert(!key_equal(bucket.first, empty_key));
     assert(!key_equal(bucket.first, key));
-    bucket = {.first = key, .second = val};
+    bucket = {key, val};
     return iterator(*this, idx);
   }
   iterator replace(const Key& key, const T& val, bool only_empty = false) {
@@ -100,7 +100,38 @@ class FlatAggrStore {
   using RankStoreIterator = typename RankStore::iterator;
   using Store = vector<RankStore>;
   using UpdateFunc = std::function<void(T, Data &...)>;
-  using DistUpdateFunc = dist_object<UpdateFunc>;
+  // receives all the elements delivered together, which are contiguous
+  using BatchUpdateFunc = std::function<void(const T *, size_t, Data &...)>;
+
+  // The functions called on the target for the updates. When the batch function is set, it is called for every delivered batch
+  // of elements (and for single elements), instead of the update function for each element.
+  struct UpdateFuncs {
+    UpdateFunc update_func;
+    BatchUpdateFunc batch_update_func;
+
+    void operator()(const T &elem, Data &... data) const {
+      if (batch_update_func)
+        batch_update_func(&elem, 1, data...);
+      else
+        update_func(elem, data...);
+    }
+
+    // updates the num_elems elements starting at iter
+    template <typename Iter>
+    void update_range(Iter iter, size_t num_elems, Data &... data) const {
+      if (!num_elems) return;
+      if (!batch_update_func) {
+        for (size_t i = 0; i < num_elems; i++, iter++) update_func(*iter, data...);
+      } else if constexpr (std::is_pointer<Iter>::value) {
+        // the elements of a view of a trivially serializable type are read in place from the rpc buffer
+        batch_update_func(iter, num_elems, data...);
+      } else {
+        vector<T> elems(iter, std::next(iter, num_elems));
+        batch_update_func(elems.data(), elems.size(), data...);
+      }
+    }
+  };
+  using DistUpdateFunc = dist_object<UpdateFuncs>;
 
   using CountType = TargetRPCCounts::CountType;
 
@@ -159,10 +190,7 @@ class FlatAggrStore {
     // increment the processed counters
     rpc_counts->set_progressed_count(source_rank, num_progressed);
 
-    auto &func = *update_func;
-    for (const auto &elem : rank_store) {
-      func(elem, data...);
-    }
+    update_func->update_range(rank_store.begin(), rank_store.size(), data...);
 #ifdef USE_HH
     for (const auto &hh_elem_count : hh_store) {
       for (int i = 0; i < hh_elem_count.second; i++) {
@@ -361,7 +389,16 @@ class FlatAggrStore {
     barrier(aggr_team);  // to avoid race of first update
     if (max_store_size_per_target > 1 && store.empty())
       DIE("Invalid condition - FlatAggrStore not initialized yet - call set_size() after construction or clear()!\n");
-    *(this->update_func) = update_func;
+    *(this->update_func) = {update_func, {}};
+    barrier(aggr_team);  // to avoid race of first update
+  }
+
+  // an alternative to set_update_func, so the target can handle a whole batch at a time
+  void set_batch_update_func(BatchUpdateFunc batch_update_func) {
+    barrier(aggr_team);  // to avoid race of first update
+    if (max_store_size_per_target > 1 && store.empty())
+      DIE("Invalid condition - FlatAggrStore not initialized yet - call set_size() after construction or clear()!\n");
+    *(this->update_func) = {{}, batch_update_func};
     barrier(aggr_team);  // to avoid race of first update
   }
 
@@ -155,7 +155,7 @@ class ThreadPool {
           DBG_VERBOSE("Finished sh_prom=", sh_prom.get(), "\n");
           // fulfill only in calling persona
           persona.lpc_ff([task_id, start_t, sh_prom]() {
-            duration_seconds s = 0;
+            duration_seconds s(0);
             DBG("Fulfilled sh_prom=", sh_prom.get(), " task_id=", task_id, " in ", s.count(), " s\n");
             sh_prom->fulfill_anonymous(1);
             global_tasks_completed()++;
@@ -191,13 +191,13 @@ class ThreadPool {
     auto sh_task =
         std::make_shared<Task>([sh_prom, task_id, start_t, &persona, func{std::move(func)}, args_tuple{std::move(args_tuple)}]() {
           auto compute_start_t = 0;
-          duration_seconds delay_s = compute_start_t - start_t;
+          duration_seconds delay_s(compute_start_t - start_t);
           DBG_VERBOSE("Executing sh_prom=", sh_prom.get(), "\n");
           std::apply(func, args_tuple);
           DBG_VERBOSE("Finished sh_prom=", sh_prom.get(), "\n");
           // fulfill only in calling persona
           persona.lpc_ff([task_id, start_t, compute_start_t, delay_s, sh_prom]() {
-            duration_seconds s = 0 - compute_start_t;
+            duration_seconds s(0 - compute_start_t);
             DBG("Fulfilled sh_prom=", sh_prom.get(), " task_id=", task_id, "of", global_task_id(), " in ", delay_s.count(), " delay + ", s.count(), " s\n");
             sh_prom->fulfill_anonymous(1);
             global_tasks_completed()++;
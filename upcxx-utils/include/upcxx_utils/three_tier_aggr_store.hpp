@@ -327,6 +327,7 @@ class ThreeTierAggrStore : public FlatAggrStore<T, Data...> {
   using MicroBlockStore = vector<MicroBlock>;
 
   using UpdateFunc = typename FAS::UpdateFunc;
+  using BatchUpdateFunc = typename FAS::BatchUpdateFunc;
   using DistUpdateFunc = typename FAS::DistUpdateFunc;
   using CountType = typename FAS::CountType;
   using DistRPCCounts = typename FAS::DistRPCCounts;
@@ -349,6 +350,18 @@ class ThreeTierAggrStore : public FlatAggrStore<T, Data...> {
 
   void tt_barrier() { barrier(splits->full_team()); }
 
+  void check_initialized() {
+    if ((tt_max_micro_store_size_per_node > 0) | (tt_max_store_size_per_node > 0)) {
+      if (tt_rpc_counts->total.is_null() || (tt_max_micro_store_size_per_node > 0 && tt_micro_store.empty()) ||
+          (tt_max_store_size_per_node > 0 && tt_store.empty())) {
+        DIE("Invalid condition - ThreeTierAggrStore not initialized yet - call set_size() first after construction or clear()! "
+            "total=",
+            tt_rpc_counts->total, ", microsize=", tt_max_micro_store_size_per_node, ", micro_storesize=", tt_micro_store.size(),
+            ", max_store_size=", tt_max_store_size_per_node, ", store.size()=", tt_store.size(), "\n");
+      }
+    }
+  }
+
   static void tt_wait_for_rpcs(ThreeTierAggrStore *astore, node_num_t target_node) {
     assert(target_node < astore->splits->node_n());
     auto &counts = astore->tt_rpc_counts;
@@ -440,11 +453,8 @@ class ThreeTierAggrStore : public FlatAggrStore<T, Data...> {
             if (thread_num == splits->thread_me()) {
               // bypass rpc on self
               DBG_VERBOSE("Bypass to self thread_num=", thread_num, ", size=", thread_sizes[thread_num], " offset=", offset, "\n");
-              for (TT_SIZE_T i = 0; i < thread_sizes[thread_num]; i++) {
-                assert(thread_iter != node_store_view.end());
-                const auto &elem = *(thread_iter++);
-                (*update_func)(elem, data...);
-              }
+              update_func->update_range(thread_iter, thread_sizes[thread_num], data...);
+              std::advance(thread_iter, thread_sizes[thread_num]);
             } else {
               DBG_VERBOSE("Sending to thread_num=", thread_num, ", size=", thread_sizes[thread_num], " offset=", offset, "\n");
 
@@ -658,19 +668,20 @@ class ThreeTierAggrStore : public FlatAggrStore<T, Data...> {
   void set_update_func(UpdateFunc update_func) {
     DBG("\n");
     tt_barrier();  // to avoid race of first update
-    if ((tt_max_micro_store_size_per_node > 0) | (tt_max_store_size_per_node > 0)) {
-      if (tt_rpc_counts->total.is_null() || (tt_max_micro_store_size_per_node > 0 && tt_micro_store.empty()) ||
-          (tt_max_store_size_per_node > 0 && tt_store.empty())) {
-        DIE("Invalid condition - ThreeTierAggrStore not initialized yet - call set_size() first after construction or clear()! "
-            "total=",
-            tt_rpc_counts->total, ", microsize=", tt_max_micro_store_size_per_node, ", micro_storesize=", tt_micro_store.size(),
-            ", max_store_size=", tt_max_store_size_per_node, ", store.size()=", tt_store.size(), "\n");
-      }
-    }
+    check_initialized();
     ((FAS *)this)->set_update_func(update_func);
     tt_barrier();  // to avoid race of first update
   }
 
+  // an alternative to set_update_func, so the target can handle a whole batch at a time
+  void set_batch_update_func(BatchUpdateFunc batch_update_func) {
+    DBG("\n");
+    tt_barrier();  // to avoid race of first update
+    check_initialized();
+    ((FAS *)this)->set_batch_update_func(batch_update_func);
+    tt_barrier();  // to avoid race of first update
+  }
+
   // TODO implement TwoTier mode where micro_stores are larger and are the only stores, so no append with threads
   void set_size(const string &desc, CountType max_store_bytes, CountType max_rpcs_in_flight = 128, bool use_heavy_hitters = true) {
     tt_rpc_counts->reset(true);
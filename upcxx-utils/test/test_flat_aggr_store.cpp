@@ -22,13 +22,14 @@ int test_flat_aggr_store(int argc, char **argv) {
   using raw_map_t = std::unordered_map<char, size_t>;
   using map_t = upcxx::dist_object<raw_map_t>;
 
-  for (int i = 0; i < 2; i++) {
+  // the last two rounds deliver the updates in batches
+  for (int i = 0; i < 4; i++) {
     upcxx::barrier();
     map_t myMap(upcxx::world());
 
     upcxx_utils::FlatAggrStore<KV> flatStore;
-    flatStore.set_size("char counter", i * 128 * upcxx::rank_n(), 100);
-    flatStore.set_update_func([&m = myMap](KV kv) {
+    flatStore.set_size("char counter", (i % 2) * 128 * upcxx::rank_n(), 100);
+    auto update_func = [&m = myMap](KV kv) {
       assert(kv.key >= ' ' && kv.key <= 'z');
       assert(kv.val == 1);
       const auto it = m->find(kv.key);
@@ -37,7 +38,15 @@ int test_flat_aggr_store(int argc, char **argv) {
       } else {
         it->second += kv.val;
       }
-    });
+    };
+    if (i < 2) {
+      flatStore.set_update_func(update_func);
+    } else {
+      flatStore.set_batch_update_func([update_func](const KV *kvs, size_t num_kvs) {
+        assert(num_kvs > 0);
+        for (size_t j = 0; j < num_kvs; j++) update_func(kvs[j]);
+      });
+    }
 
     string data("The quick brown fox jumped over the lazy dog's tail...");
 